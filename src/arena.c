@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "arena.h"
+
+#define TN_ARENA_ALIGN (_Alignof (max_align_t))
+#define TN_ARENA_INIT (16 * 1024)
+#define TN_ARENA_MAX (1024 * 1024)
+
+void tn_arena_init (struct tn_arena *arena)
+{
+	arena->blocks = NULL;
+	arena->ptr = arena->end = NULL;
+	arena->size = TN_ARENA_INIT;
+}
+
+// blocks double in size up to TN_ARENA_MAX, anything bigger than that gets a block to itself
+static int tn_arena_block (struct tn_arena *arena, size_t size)
+{
+	struct tn_arena_block *block;
+
+	if (size < arena->size)
+		size = arena->size;
+
+	if (!(block = malloc (sizeof (*block) + size))) {
+		tn_error ("malloc failed\n");
+		return 1;
+	}
+
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->ptr = (char*)block->data;
+	arena->end = arena->ptr + size;
+
+	if (arena->size < TN_ARENA_MAX)
+		arena->size *= 2;
+
+	return 0;
+}
+
+void *tn_arena_alloc (struct tn_arena *arena, size_t size)
+{
+	void *ret;
+
+	size = (size + TN_ARENA_ALIGN - 1) & ~(TN_ARENA_ALIGN - 1);
+
+	if (size > (size_t)(arena->end - arena->ptr) && tn_arena_block (arena, size))
+		return NULL;
+
+	ret = arena->ptr;
+	arena->ptr += size;
+
+	return ret;
+}
+
+// the most recent allocation grows in place if there's room, anything else is copied
+void *tn_arena_realloc (struct tn_arena *arena, void *ptr, size_t old, size_t size)
+{
+	char *p = ptr;
+	void *ret;
+
+	old = (old + TN_ARENA_ALIGN - 1) & ~(TN_ARENA_ALIGN - 1);
+
+	if (p && p + old == arena->ptr && size <= (size_t)(arena->end - p)) {
+		arena->ptr = p + ((size + TN_ARENA_ALIGN - 1) & ~(TN_ARENA_ALIGN - 1));
+		return ptr;
+	}
+
+	if (!(ret = tn_arena_alloc (arena, size)))
+		return NULL;
+
+	if (p)
+		memcpy (ret, p, old < size ? old : size);
+
+	return ret;
+}
+
+void tn_arena_free (struct tn_arena *arena)
+{
+	struct tn_arena_block *it, *next;
+
+	for (it = arena->blocks; it; it = next) {
+		next = it->next;
+		free (it);
+	}
+
+	tn_arena_init (arena);
+}
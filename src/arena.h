@@ -0,0 +1,24 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stddef.h>
+
+/* bump allocator for everything that only lives as long as one compilation:
+   the syntax tree and the byte code. nothing is freed on its own, the whole
+   lot goes at once in tn_arena_free */
+struct tn_arena {
+	struct tn_arena_block {
+		struct tn_arena_block *next;
+		max_align_t data[];
+	} *blocks;
+
+	char *ptr, *end;
+	size_t size; // of the next block
+};
+
+void tn_arena_init (struct tn_arena *arena);
+void *tn_arena_alloc (struct tn_arena *arena, size_t size);
+void *tn_arena_realloc (struct tn_arena *arena, void *ptr, size_t old, size_t size);
+void tn_arena_free (struct tn_arena *arena);
+
+#endif
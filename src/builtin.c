@@ -25,7 +25,6 @@ static void tn_builtin_apply (struct tn_vm *vm, int n)
 	// apply (fn, [1 2 3]) == [1 2 3] fn apply call
 	int nargs;
 	struct tn_value *fn, *args;
-	struct tn_scope *sc;
 	
 	if (n != 2 || tn_value_get_args (vm, "al", &fn, &args)) {
 		tn_error ("invalid arguments passed to apply\n");
@@ -33,26 +32,21 @@ static void tn_builtin_apply (struct tn_vm *vm, int n)
 		return;
 	}
 
-	// arguments are passed in via a list, so we recursively push every element of it
-	nargs = tn_builtin_ldecon (vm, args);
-
-	if (fn->type == VAL_CLSR) {
-		sc = vm->sc;
-		tn_vm_exec (vm, fn->data.cl->ch, fn, NULL, nargs);
-		vm->sc = sc;
-	}
-	else if (fn->type == VAL_CFUN)
-		fn->data.cfun (vm, nargs);
-	else {
+	if (tn_type (fn) != VAL_CLSR && tn_type (fn) != VAL_CFUN) {
 		tn_error ("non-function passed to apply\n");
 		tn_vm_push (vm, &nil);
+		return;
 	}
+
+	// arguments are passed in via a list, so we recursively push every element of it
+	nargs = tn_builtin_ldecon (vm, args);
+	tn_vm_tailcall (vm, fn, nargs);
 }
 
 static void tn_builtin_range (struct tn_vm *vm, int n)
 {
-	int i, start, end, step;
-	struct tn_value *lst = &nil, *num;
+	int i, top, start, end, step;
+	struct tn_value *lst = &nil, *num = &nil;
 
 	if (n < 2 || (n == 2 && tn_value_get_args (vm, "ii", &start, &end))
 	 || (n == 3 && tn_value_get_args (vm, "iii", &start, &end, &step))) {
@@ -66,19 +60,24 @@ static void tn_builtin_range (struct tn_vm *vm, int n)
 
 	end -= start % step; // start % step and end % step need to be the same
 
+	top = tn_gc_root (vm->gc, &lst);
+	tn_gc_root (vm->gc, &num);
+
 	for (i = end; start < end ? i >= start : i <= start; i -= step) {
-		num = tn_gc_preserve (tn_int (vm, i));
+		num = tn_int (vm, i);
 
-		lst = tn_gc_preserve (tn_pair (vm, num, lst));
+		if (!(lst = tn_pair (vm, num, lst)))
+			break;
 	}
 
-	tn_gc_release_list (lst); 
+	tn_gc_unroot (vm->gc, top);
 	tn_vm_push (vm, lst);
 }
 
 struct tn_hash *tn_list_module (struct tn_vm *vm);
 struct tn_hash *tn_string_module (struct tn_vm *vm);
 struct tn_hash *tn_io_module (struct tn_vm *vm);
+struct tn_hash *tn_gc_module (struct tn_vm *vm);
 int tn_builtin_init (struct tn_vm *vm)
 {
 	tn_vm_setglobal (vm, "apply", tn_cfun (vm, tn_builtin_apply));
@@ -86,6 +85,7 @@ int tn_builtin_init (struct tn_vm *vm)
 	tn_vm_setglobal (vm, "string", tn_cmod (vm, tn_string_module (vm)));
 	tn_vm_setglobal (vm, "io", tn_cmod (vm, tn_io_module (vm)));
 	tn_vm_setglobal (vm, "list", tn_cmod (vm, tn_list_module (vm)));
+	tn_vm_setglobal (vm, "gc", tn_cmod (vm, tn_gc_module (vm)));
 
 	return 0;
 }
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "intern.h"
+#include "opcode.h"
+#include "value.h"
+#include "gc.h"
+#include "vm.h"
+
+/* turns the byte code produced by gen.c into an array of pointer-sized words
+   that the VM executes directly. every instruction becomes one word holding the
+   opcode, followed by one word per operand, with strings, jump targets and
+   sub-chunks already resolved. string literals and doubles that don't fit in an
+   immediate become values in the chunk's constant pool, so pushing them doesn't
+   allocate anything. the pool is traced through the chunk's owner, since the
+   constants can end up being used after the chunk itself is gone. the byte code
+   is only the compiler's output, and goes away with its arena once it's been
+   decoded, so the disassembler works on the decoded words too */
+
+static uint16_t tn_decode_read16 (struct tn_chunk *ch)
+{
+	uint16_t i;
+
+	i = ch->code[ch->pc++];
+	i |= ch->code[ch->pc++] << 8;
+
+	return i;
+}
+
+static uint32_t tn_decode_read32 (struct tn_chunk *ch)
+{
+	uint32_t i;
+
+	i = ch->code[ch->pc++];
+	i |= ch->code[ch->pc++] << 8;
+	i |= ch->code[ch->pc++] << 16;
+	i |= (uint32_t)ch->code[ch->pc++] << 24;
+
+	return i;
+}
+
+static uint64_t tn_decode_read64 (struct tn_chunk *ch)
+{
+	uint64_t i = tn_decode_read32 (ch);
+	return i | (uint64_t)tn_decode_read32 (ch) << 32;
+}
+
+static double tn_decode_readdouble (struct tn_chunk *ch)
+{
+	uint64_t u64 = tn_decode_read64 (ch);
+	double *d = (double*)&u64;
+	return *d;
+}
+
+static char *tn_decode_readstring (struct tn_chunk *ch)
+{
+	uint16_t len;
+	char *ret;
+
+	len = tn_decode_read16 (ch);
+	ret = strndup ((char*)ch->code + ch->pc, len);
+	if (!ret)
+		return NULL;
+
+	ch->pc += len;
+	return ret;
+}
+
+// names are interned, rather than copied, so they can be hash keys
+static const char *tn_decode_readname (struct tn_chunk *ch)
+{
+	uint16_t len = tn_decode_read16 (ch);
+	const char *ret = tn_intern_len ((char*)ch->code + ch->pc, len);
+
+	ch->pc += len;
+	return ret;
+}
+
+// skip over an instruction in the byte code, returning how many words it'll decode to
+static int tn_decode_skip (struct tn_chunk *ch)
+{
+	switch (ch->code[ch->pc++]) {
+		case OP_PSHI: case OP_SET: case OP_JMP: case OP_JNZ:
+		case OP_JZ: case OP_CALL: case OP_TCAL: case OP_EQJZ: case OP_NEQJZ:
+		case OP_LTJZ: case OP_LTEJZ: case OP_GTJZ: case OP_GTEJZ:
+			ch->pc += 4;
+			return 2;
+		case OP_PSHD:
+			ch->pc += 8;
+			return 2;
+		case OP_PSHV:
+			ch->pc += 6;
+			return 2;
+		case OP_CLSR:
+			ch->pc += 2;
+			return 2;
+		case OP_ARGS:
+			ch->pc += 5;
+			return 2;
+		case OP_PSHS: case OP_GLOB: case OP_ACCS: case OP_IMPT:
+			ch->pc += tn_decode_read16 (ch);
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+static struct tn_value *tn_decode_const (struct tn_vm *vm, struct tn_chunk *ch, enum tn_val_type type, union tn_val_data data)
+{
+	struct tn_value *ret = tn_value_new (vm, type, data);
+
+	if (ret) {
+		array_add (ch->consts, ret);
+		tn_gc_barrier (vm->gc, ch->owner, ret);
+	}
+
+	return ret;
+}
+
+// ch->owner needs to be set, and kept alive by the caller
+int tn_decode (struct tn_vm *vm, struct tn_chunk *ch)
+{
+	int i;
+	uint8_t op;
+	uint32_t len = ch->pc, *words; // byte offset -> word offset, for resolving jumps
+	union tn_insn *it;
+
+	words = malloc ((len + 1) * sizeof (*words));
+
+	if (!words) {
+		tn_error ("malloc failed\n");
+		return 1;
+	}
+
+	// first pass, figure out where each instruction ends up
+	ch->insnlen = 0;
+	ch->pc = 0;
+
+	while (ch->pc < len) {
+		words[ch->pc] = ch->insnlen;
+		ch->insnlen += tn_decode_skip (ch);
+	}
+
+	words[len] = ch->insnlen;
+	ch->pc = len;
+
+	// zeroed, so that tn_decode_free can deal with whatever a failure leaves behind
+	ch->insns = calloc (ch->insnlen, sizeof (*ch->insns));
+
+	if (!ch->insns) {
+		tn_error ("malloc failed\n");
+		free (words);
+		return 1;
+	}
+
+	// second pass, actually decode everything
+	it = ch->insns;
+	ch->pc = 0;
+
+	while (ch->pc < len) {
+		op = ch->code[ch->pc++];
+		(it++)->op = op;
+
+		switch (op) {
+			case OP_PSHI:
+				(it++)->i = tn_decode_read32 (ch);
+				break;
+			case OP_PSHD: {
+				double d = tn_decode_readdouble (ch);
+				struct tn_value *v = tn_value_flonum (d);
+
+				if (!v && !(v = tn_decode_const (vm, ch, VAL_DBL, (union tn_val_data) { .d = d })))
+					goto error;
+
+				(it++)->v = v;
+				break;
+			}
+			case OP_PSHS: {
+				char *s = tn_decode_readstring (ch);
+				struct tn_value *v;
+
+				if (!s || !(v = tn_decode_const (vm, ch, VAL_STR, (union tn_val_data) { .s = s })))
+					goto error;
+
+				(it++)->v = v;
+				break;
+			}
+			case OP_GLOB:
+			case OP_ACCS:
+			case OP_IMPT:
+				if (!((it++)->s = tn_decode_readname (ch)))
+					goto error;
+				break;
+			case OP_PSHV:
+				it->var.depth = tn_decode_read16 (ch);
+				(it++)->var.idx = tn_decode_read32 (ch) - 1;
+				break;
+			case OP_SET:
+				(it++)->u = tn_decode_read32 (ch) - 1;
+				break;
+			case OP_CLSR:
+				(it++)->ch = ch->subch[tn_decode_read16 (ch)];
+				break;
+			case OP_ARGS:
+				it->args.varargs = ch->code[ch->pc++];
+				(it++)->args.n = tn_decode_read32 (ch);
+				break;
+			case OP_JMP:
+			case OP_JNZ:
+			case OP_JZ:
+			case OP_EQJZ: case OP_NEQJZ: case OP_LTJZ:
+			case OP_LTEJZ: case OP_GTJZ: case OP_GTEJZ:
+				(it++)->jmp = ch->insns + words[tn_decode_read32 (ch)];
+				break;
+			case OP_CALL:
+			case OP_TCAL:
+				(it++)->u = tn_decode_read32 (ch);
+				break;
+			default: break;
+		}
+	}
+
+	ch->pc = len;
+	free (words);
+
+	// the byte code goes away with the arena it was compiled into
+	ch->code = NULL;
+	ch->arena = NULL;
+
+	for (i = 0; i < ch->subch_num; i++) {
+		ch->subch[i]->owner = ch->owner;
+
+		if (tn_decode (vm, ch->subch[i]))
+			return 1;
+	}
+
+	return 0;
+
+error:
+	tn_error ("malloc failed\n");
+	ch->pc = len;
+	free (words);
+	return 1;
+}
+
+// frees the instructions of ch, but not its sub-chunks or constants
+void tn_decode_free (struct tn_chunk *ch)
+{
+	free (ch->insns);
+	ch->insns = NULL;
+}
@@ -0,0 +1,9 @@
+#ifndef DECODE_H__
+#define DECODE_H__
+
+struct tn_vm;
+struct tn_chunk;
+int tn_decode (struct tn_vm *vm, struct tn_chunk *ch);
+void tn_decode_free (struct tn_chunk *ch);
+
+#endif
@@ -1,211 +1,828 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "error.h"
 #include "hash.h"
 #include "value.h"
 #include "vm.h"
+#include "gen.h"
 #include "gc.h"
 
-#define printf(...) (0) // shut up
-struct tn_value *tn_gc_init_pool (uint32_t size)
+/* values are split into two generations. new values are young, and most of
+   them die before the next collection, so a minor collection only traces young
+   values and promotes whatever survives to the old generation. the old
+   generation is only traced by a major collection, which happens once it has
+   grown enough since the last one.
+
+   values can't be moved (C code holds on to raw pointers to them all over the
+   place), so "promotion" just means setting GC_OLD and the value's bit in its
+   page's old bitmap. a minor collection starts out with every old value marked,
+   so it never looks at them.
+
+   old values pointing to young ones must be found by a minor collection without
+   tracing the old generation, which is what the remembered set is for: stores
+   into a value go through tn_gc_barrier, and captured variables are written to
+   freely while their scope runs, so tn_vm_free_scope passes them to
+   tn_gc_touch once it returns. globals, the stack, the active scopes, and
+   whatever C code registered with tn_gc_root are always scanned.
+
+   besides plain data, the heap holds the variables that closures and modules
+   capture (VAL_SCOPE) and the compiled code closures point into (VAL_CHUNK),
+   so that code is freed once nothing can run it anymore.
+
+   pages aren't swept right after marking. instead, tn_gc_alloc sweeps them one
+   at a time when it runs out of room, and whatever is left gets swept before
+   the next collection. pages that turn out to be empty then are freed. young
+   values only live on pages that have been allocated from since the last
+   collection, so those are the only ones a minor collection needs to sweep.
+
+   major collections are incremental by default: marking is done a slice at a
+   time, every GC_SLICE_EVERY allocations. anything allocated in the meantime is
+   marked right away, and anything stored into a value that might have been
+   scanned already is marked through the barrier. see tn_gc_major_finish */
+
+#ifdef __GNUC__
+#define tn_gc_ctz(X) __builtin_ctzll (X)
+#else
+static int tn_gc_ctz (uint64_t x)
 {
-	struct tn_value *ret;
-	int i;
+	int ret = 0;
+
+	while (!(x & 1)) {
+		x >>= 1;
+		ret++;
+	}
+
+	return ret;
+}
+#endif
 
-	ret = malloc (size * sizeof (*ret));
+// bits of word w that correspond to actual values
+#define tn_gc_valid(W) ((W) == GC_PAGE_WORDS - 1 && GC_PAGE_VALUES % 64 \
+	? (UINT64_C (1) << GC_PAGE_VALUES % 64) - 1 : ~UINT64_C (0))
+
+static struct tn_gc_page *tn_gc_page_new (struct tn_gc *gc)
+{
+	struct tn_gc_page *ret = aligned_alloc (GC_PAGE_SIZE, GC_PAGE_SIZE);
 
 	if (!ret)
 		return NULL;
 
-	printf ("gc: allocated %u struct tn_values\n", size);
+	memset (ret, 0, offsetof (struct tn_gc_page, values));
 
-	for (i = 0; i < size - 1; i++)
-		ret[i].next = &ret[i + 1];
+	ret->prev = NULL;
+	ret->next = gc->pages;
 
-	ret[size - 1].next = NULL;
+	if (gc->pages)
+		gc->pages->prev = ret;
+
+	gc->pages = ret;
+	gc->stats.pages++;
 
 	return ret;
 }
 
-struct tn_gc *tn_gc_init (struct tn_vm *vm, uint32_t bytes)
+static int tn_gc_page_empty (struct tn_gc_page *page)
+{
+	int w;
+
+	for (w = 0; w < GC_PAGE_WORDS; w++)
+		if (page->alloc[w])
+			return 0;
+
+	return 1;
+}
+
+static int tn_gc_page_full (struct tn_gc_page *page)
+{
+	int w;
+
+	for (w = 0; w < GC_PAGE_WORDS; w++)
+		if (page->alloc[w] != tn_gc_valid (w))
+			return 0;
+
+	return 1;
+}
+
+static void tn_gc_page_young (struct tn_gc *gc, struct tn_gc_page *page)
+{
+	if (!page->young) {
+		page->young = 1;
+		array_add (gc->young_pages, page);
+	}
+}
+
+static void tn_gc_page_free (struct tn_gc *gc, struct tn_gc_page *page)
+{
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		gc->pages = page->next;
+
+	if (page->next)
+		page->next->prev = page->prev;
+
+	gc->stats.pages--;
+	free (page);
+}
+
+// sizes can have a k, m or g suffix
+static void tn_gc_env_size (const char *name, size_t *out)
+{
+	char *s = getenv (name), *end;
+	unsigned long long n;
+
+	if (!s || !*s)
+		return;
+
+	n = strtoull (s, &end, 10);
+
+	switch (*end) {
+		case 'g': case 'G': n *= 1024; // fall through
+		case 'm': case 'M': n *= 1024; // fall through
+		case 'k': case 'K': n *= 1024;
+	}
+
+	*out = n;
+}
+
+// fill in the defaults, then let the environment override whatever it sets
+static void tn_gc_opts_init (struct tn_gc_opts *opts)
+{
+	char *s;
+
+	tn_gc_env_size ("TRITON_HEAP_INIT", &opts->init);
+	tn_gc_env_size ("TRITON_HEAP_MAX", &opts->max);
+
+	if ((s = getenv ("TRITON_HEAP_GROWTH")) && *s)
+		opts->growth = strtod (s, NULL);
+
+	if ((s = getenv ("TRITON_HEAP_SHRINK")) && *s)
+		opts->shrink_after = strtoul (s, NULL, 10);
+
+	if (!opts->init)
+		opts->init = GC_HEAP_INIT;
+
+	if (opts->growth <= 1)
+		opts->growth = GC_HEAP_GROWTH;
+
+	if (!opts->shrink_after)
+		opts->shrink_after = GC_SHRINK_AFTER;
+
+	if (opts->max && opts->max < opts->init)
+		opts->init = opts->max;
+}
+
+struct tn_gc *tn_gc_init (struct tn_vm *vm, const struct tn_gc_opts *opts)
 {
 	struct tn_gc *ret = malloc (sizeof (*ret));
 
 	if (!ret)
 		return NULL;
 
-	ret->free = tn_gc_init_pool (bytes / sizeof (*ret->free));
+	if (opts)
+		ret->opts = *opts;
+	else
+		memset (&ret->opts, 0, sizeof (ret->opts));
 
-	if (!ret->free) {
-		free (ret);
-		return NULL;
-	}
+	tn_gc_opts_init (&ret->opts);
+
+	ret->pages = ret->cur = NULL;
+	memset (&ret->stats, 0, sizeof (ret->stats));
+
+	array_init (ret->young_pages);
+	array_init (ret->sweep);
+	array_init (ret->avail);
+	array_init (ret->rset);
+	array_init (ret->mark);
+	array_init (ret->roots);
+
+	if (!ret->young_pages || !ret->sweep || !ret->avail || !ret->rset || !ret->mark || !ret->roots)
+		goto error;
+
+	do {
+		struct tn_gc_page *page = tn_gc_page_new (ret);
+
+		if (!page)
+			goto error;
 
-	ret->used = NULL;
-	ret->num_nodes = bytes / sizeof (*ret->free);
+		array_add (ret->avail, page);
+	} while (ret->stats.pages * GC_PAGE_SIZE < ret->opts.init);
+
+	ret->young_num = ret->old_num = 0;
+	ret->major_at = GC_NURSERY;
+	ret->major_old = ret->low_cycles = 0;
 	ret->vm = vm;
-	ret->on = 1;
+	ret->state = GC_IDLE;
+	ret->major_sweep = 0;
+	ret->slice = GC_SLICE;
+
+	ret->trace = getenv ("TRITON_GC_TRACE") && strcmp (getenv ("TRITON_GC_TRACE"), "0");
+	ret->cycle_us = ret->cycle_slices = 0;
+	timespec_get (&ret->start, TIME_UTC);
 
 	return ret;
+
+error:
+	while (ret->pages)
+		tn_gc_page_free (ret, ret->pages);
+
+	free (ret->young_pages);
+	free (ret->sweep);
+	free (ret->avail);
+	free (ret->rset);
+	free (ret->mark);
+	free (ret->roots);
+	free (ret);
+	return NULL;
 }
 
-struct tn_value *tn_gc_resize (struct tn_gc *gc)
+void tn_gc_remember (struct tn_gc *gc, struct tn_value *val)
 {
-	gc->free = tn_gc_init_pool (gc->num_nodes);
-	printf ("gc: allocated %u more nodes\n", gc->num_nodes);
-	gc->num_nodes *= 2;
-
-	return gc->free;
+	val->flags |= GC_REMEMBERED;
+	array_add (gc->rset, val);
 }
 
-void tn_gc_scan (struct tn_value *v)
+// marks v, and queues it up to have whatever it points to marked as well
+static void tn_gc_mark (struct tn_gc *gc, struct tn_value *v)
 {
+	struct tn_gc_page *page;
+	uint64_t bit;
 	int i;
 
-	if (!v || v->flags & GC_MARKED)
+	if (!v || tn_is_imm (v) || v->flags & GC_STATIC)
+		return;
+
+	page = tn_gc_page (v);
+	i = v - page->values;
+	bit = UINT64_C (1) << (i % 64);
+
+	if (page->mark[i / 64] & bit)
 		return;
 
-	v->flags |= GC_MARKED;
+	// everything that gets marked survives, and is old from now on
+	page->mark[i / 64] |= bit;
+	v->flags |= GC_OLD;
+	gc->old_num++;
+	array_add (gc->mark, v);
+
+	if (gc->mark_num > gc->stats.mark_peak)
+		gc->stats.mark_peak = gc->mark_num;
+}
+
+void tn_gc_shade (struct tn_gc *gc, struct tn_value *val)
+{
+	tn_gc_mark (gc, val);
+}
+
+/* call this after writing to obj without going through tn_gc_barrier, like
+   the variables of a scope that has been running */
+void tn_gc_touch (struct tn_gc *gc, struct tn_value *obj)
+{
+	struct tn_gc_page *page = tn_gc_page (obj);
+	int i = obj - page->values;
+
+	// if it's been scanned already, it has to be scanned again
+	if (gc->state == GC_MARK && page->mark[i / 64] & UINT64_C (1) << (i % 64))
+		array_add (gc->mark, obj);
+
+	if ((obj->flags & (GC_OLD | GC_REMEMBERED)) == GC_OLD)
+		tn_gc_remember (gc, obj);
+}
+
+// the constant pools of a whole tree of chunks
+static void tn_gc_mark_consts (struct tn_gc *gc, struct tn_chunk *ch)
+{
+	int i;
+
+	for (i = 0; i < ch->consts_num; i++)
+		tn_gc_mark (gc, ch->consts[i]);
 
-	if (v->type == VAL_PAIR) {
-		tn_gc_scan (v->data.pair.a);
-		tn_gc_scan (v->data.pair.b);
+	for (i = 0; i < ch->subch_num; i++)
+		tn_gc_mark_consts (gc, ch->subch[i]);
+}
+
+// marks everything v points to
+static void tn_gc_trace (struct tn_gc *gc, struct tn_value *v)
+{
+	int i;
+
+	switch (v->type) {
+		case VAL_PAIR:
+			tn_gc_mark (gc, v->data.pair.a);
+			tn_gc_mark (gc, v->data.pair.b);
+			break;
+		case VAL_CLSR:
+			tn_gc_mark (gc, v->data.cl.ch->owner);
+			tn_gc_mark (gc, v->data.cl.env);
+			break;
+		case VAL_SCOPE:
+			for (i = 0; i < v->data.env.vars->arr_num; i++)
+				tn_gc_mark (gc, v->data.env.vars->arr[i]);
+
+			if (v->data.env.vars->ch)
+				tn_gc_mark (gc, v->data.env.vars->ch->owner);
+
+			tn_gc_mark (gc, v->data.env.up);
+			break;
+		case VAL_CMOD:
+			for (i = 0; i < v->data.cmod->size; i++)
+				tn_gc_mark (gc, v->data.cmod->entries[i].data);
+			break;
+		case VAL_CHUNK:
+			tn_gc_mark_consts (gc, v->data.ch);
+			break;
+		default: break;
 	}
-	else if (v->type == VAL_CLSR) {
-		struct tn_scope *sit = v->data.cl->sc;
+}
 
-		while (sit) {
-			for (i = 0; i < sit->vars->arr_num; i++)
-				tn_gc_scan (sit->vars->arr[i]);
+/* scan up to budget values off of the mark stack, or everything if budget is
+   negative. returns 1 once the mark stack is empty. this used to recurse, which
+   meant a long list needed one C stack frame per element. now, a list's spine
+   just takes up one slot on the mark stack at a time */
+static int tn_gc_drain (struct tn_gc *gc, int budget)
+{
+	while (gc->mark_num > 0) {
+		if (budget >= 0 && budget-- == 0)
+			return 0;
 
-			sit = sit->next;
-		}
+		tn_gc_trace (gc, gc->mark[--gc->mark_num]);
+	}
+
+	return 1;
+}
+
+static void tn_gc_free_value (struct tn_gc *gc, struct tn_value *vit)
+{
+	gc->stats.live--;
+
+	if (vit->type == VAL_STR) {
+		gc->stats.payload -= strlen (vit->data.s) + 1;
+		free (vit->data.s);
 	}
-	else if (v->type == VAL_CMOD) {
-		for (i = 0; i < v->data.cmod->size; i++)
-			tn_gc_scan (v->data.cmod->entries[i].data);
+	else if (vit->type == VAL_CVAL && vit->data.cval.free)
+		vit->data.cval.free (vit->data.cval.v);
+	else if (vit->type == VAL_SCOPE) {
+		free (vit->data.env.vars->arr);
+		free (vit->data.env.vars);
 	}
+	else if (vit->type == VAL_CHUNK)
+		tn_gen_free (vit->data.ch);
 }
 
-struct tn_value *tn_gc_collect (struct tn_gc *gc)
+/* frees every unmarked value on a page. only values that are actually freed
+   are touched, everything else is just bitmaps */
+static void tn_gc_sweep_page (struct tn_gc *gc, struct tn_gc_page *page)
+{
+	int w, i;
+	uint64_t dead;
+	struct tn_value *v;
+
+	for (w = 0; w < GC_PAGE_WORDS; w++) {
+		dead = page->alloc[w] & ~page->mark[w];
+
+		while (dead) {
+			i = tn_gc_ctz (dead);
+			dead &= dead - 1;
+
+			v = &page->values[w * 64 + i];
+
+			tn_gc_free_value (gc, v);
+		}
+
+		page->alloc[w] = page->old[w] = page->mark[w];
+	}
+
+	page->hint = 0;
+}
+
+// give empty pages back until the heap is down to its initial size
+static void tn_gc_shrink (struct tn_gc *gc)
 {
 	int i;
-	struct tn_value *vit = gc->used, *prev, *next;
-	struct tn_scope *sit = gc->vm->sc, *snext;
 
-	printf ("gc: started cycle\n");
+	for (i = gc->avail_num - 1; i >= 0 && gc->stats.pages * GC_PAGE_SIZE > gc->opts.init; i--) {
+		if (tn_gc_page_empty (gc->avail[i])) {
+			tn_gc_page_free (gc, gc->avail[i]);
+			gc->avail[i] = gc->avail[--gc->avail_num];
+		}
+	}
+}
 
-	// unmark every used value
-	while (vit) {
-		vit->flags &= ~GC_MARKED;
-		vit = vit->next;
+/* once a major collection is swept, decide when the next one happens. the
+   more of the old generation survived, the more it's allowed to grow first,
+   since collecting it again soon would mostly find live values */
+static void tn_gc_resize (struct tn_gc *gc)
+{
+	double survival = gc->major_old ? (double)gc->old_num / gc->major_old : 1;
+	double growth = (1 + gc->opts.growth) / 2 + (gc->opts.growth - 1) / 2 * (survival < 1 ? survival : 1);
+	uint64_t at = gc->old_num * growth;
+
+	// leave room for a nursery's worth of values under the limit
+	if (gc->opts.max) {
+		uint64_t max = gc->opts.max / GC_PAGE_SIZE * GC_PAGE_VALUES;
+
+		if (at + GC_NURSERY > max)
+			at = max > 2 * GC_NURSERY ? max - GC_NURSERY : GC_NURSERY;
 	}
 
-	// scan globals
-	for (i = 0; i < gc->vm->globals->size; i++)
-		tn_gc_scan (gc->vm->globals->entries[i].data);
+	gc->major_at = at > GC_NURSERY ? at : GC_NURSERY;
+}
+
+// sweep a page that the last collection left behind
+static struct tn_gc_page *tn_gc_sweep_next (struct tn_gc *gc)
+{
+	struct tn_gc_page *page = gc->sweep[--gc->sweep_num];
+
+	tn_gc_sweep_page (gc, page);
+
+	// the old generation's size is only known once a major collection is swept
+	if (gc->sweep_num == 0 && gc->major_sweep) {
+		gc->major_sweep = 0;
+		tn_gc_resize (gc);
+	}
+
+	return page;
+}
+
+/* sweep up to budget values worth of pages that the last collection left
+   behind, or all of them if budget is negative. empty pages are kept around
+   for later, tn_gc_check_occupancy decides when to give them back */
+static void tn_gc_finish_sweep (struct tn_gc *gc, int budget)
+{
+	struct tn_gc_page *page;
+
+	while (gc->sweep_num > 0 && (budget < 0 || budget > 0)) {
+		page = tn_gc_sweep_next (gc);
+
+		if (!tn_gc_page_full (page))
+			array_add (gc->avail, page);
+
+		if (budget > 0)
+			budget = budget > GC_PAGE_VALUES ? budget - GC_PAGE_VALUES : 0;
+	}
+}
+
+/* called after every minor collection. the old generation is (close to)
+   everything that's alive then, so once it's been a small part of the heap
+   for long enough, whatever is left to sweep gets swept and the empty pages
+   are given back */
+static void tn_gc_check_occupancy (struct tn_gc *gc)
+{
+	if (gc->old_num < gc->stats.pages * GC_PAGE_VALUES * GC_LOW_OCCUPANCY)
+		gc->low_cycles++;
+	else
+		gc->low_cycles = 0;
+
+	if (gc->low_cycles >= gc->opts.shrink_after) {
+		tn_gc_finish_sweep (gc, -1);
+		tn_gc_shrink (gc);
+		gc->low_cycles = 0;
+	}
+}
+
+static void tn_gc_clear_young (struct tn_gc *gc)
+{
+	int i;
+
+	for (i = 0; i < gc->young_pages_num; i++)
+		gc->young_pages[i]->young = 0;
+
+	gc->young_pages_num = 0;
+}
+
+/* mark everything that's directly reachable. a scope that hasn't run since it
+   was scanned can't have been changed, and neither can any scope below it, so a
+   minor collection stops there. this keeps deep recursion from making every
+   minor collection slow. the running scope is never taken as scanned, since it
+   carries on changing afterwards */
+static void tn_gc_mark_roots (struct tn_gc *gc, uint8_t minor)
+{
+	int i;
+	struct tn_scope *sit = gc->vm->sc;
+
+	for (i = 0; i < gc->vm->gvals_num; i++)
+		tn_gc_mark (gc, gc->vm->gvals[i]);
+
+	tn_gc_mark (gc, gc->vm->tcall);
 
-	// traverse the stack
 	for (i = 0; gc->vm->stack[i]; i++)
-		tn_gc_scan (gc->vm->stack[i]);
+		tn_gc_mark (gc, gc->vm->stack[i]);
+
+	for (i = 0; i < gc->roots_num; i++)
+		tn_gc_mark (gc, *gc->roots[i]);
+
+	while (sit && !(minor && sit->scanned)) {
+		sit->scanned = sit != gc->vm->sc;
+		tn_gc_mark (gc, sit->cl);
+		tn_gc_mark (gc, sit->env);
+		tn_gc_mark (gc, sit->up);
+		tn_gc_mark (gc, sit->ch->owner);
 
-	// go through each scope's variables and mark each one that is still reachable
-	while (sit) {
 		for (i = 0; i < sit->vars->arr_num; i++)
-			tn_gc_scan (sit->vars->arr[i]);
+			tn_gc_mark (gc, sit->vars->arr[i]);
 
 		sit = sit->gc_next;
 	}
+}
 
-	vit = gc->used;
-	prev = NULL;
-	while (vit) {
-		if (vit->flags != 0) {
-			printf ("gc: 0x%08lx still reachable (%i)\n", vit, vit->type);
-			prev = vit;
-			vit = vit->next;
-		}
-		else {
-			printf ("gc: freeing 0x%08lx\n", vit);
+/* the remembered set is only needed by a minor collection, but either way
+   every survivor is old afterwards, so nothing old points to anything young */
+static void tn_gc_clear_remembered (struct tn_gc *gc, uint8_t minor)
+{
+	int i;
+
+	for (i = 0; i < gc->rset_num; i++) {
+		if (minor)
+			tn_gc_trace (gc, gc->rset[i]);
 
-			if (vit->type == VAL_CLSR) {
-				printf ("gc: closure %lx\n", vit->data.cl);
-				sit = vit->data.cl->sc;
-				while (sit) {
-					snext = sit->next;
+		gc->rset[i]->flags &= ~GC_REMEMBERED;
+	}
 
-					if (--sit->vars->refs == 0) {
-						free (sit->vars->arr);
-						free (sit->vars);
-					}
+	gc->rset_num = 0;
+}
 
-					free (sit);
-					sit = snext;
-				}
+// every page is swept after a major collection
+static void tn_gc_sweep_all (struct tn_gc *gc)
+{
+	struct tn_gc_page *page;
 
-				free (vit->data.cl);
-			}
-			else if (vit->type == VAL_STR)
-				free (vit->data.s);
-			else if (vit->type == VAL_CVAL && vit->data.cval.free)
-				vit->data.cval.free (vit->data.cval.v);
+	for (page = gc->pages; page; page = page->next)
+		array_add (gc->sweep, page);
 
-			next = vit->next;
-			vit->next = gc->free;
-			gc->free = vit;
+	gc->avail_num = 0;
+	gc->major_sweep = 1;
 
-			if (prev)
-				prev->next = next;
-			else
-				gc->used = next;
+	// the current page needs to be swept before anything else is allocated on it
+	gc->cur = NULL;
+}
 
-			vit = next;
+static void tn_gc_minor (struct tn_gc *gc)
+{
+	int i;
+	struct tn_gc_page *page;
+
+	gc->stats.minor++;
+
+	/* a minor collection assumes that every old value is alive. pages without
+	   any young values on them already have their mark bits set that way, since
+	   sweeping sets the old bits to the mark bits */
+	for (i = 0; i < gc->young_pages_num; i++) {
+		page = gc->young_pages[i];
+		memcpy (page->mark, page->old, sizeof (page->mark));
+		array_add (gc->sweep, page);
+	}
+
+	tn_gc_clear_young (gc);
+	tn_gc_mark_roots (gc, 1);
+	tn_gc_clear_remembered (gc, 1);
+	tn_gc_drain (gc, -1);
+
+	gc->cur = NULL;
+}
+
+static void tn_gc_major_start (struct tn_gc *gc)
+{
+	struct tn_gc_page *page;
+
+	gc->stats.major++;
+	gc->major_old = gc->old_num;
+
+	for (page = gc->pages; page; page = page->next)
+		memset (page->mark, 0, sizeof (page->mark));
+
+	tn_gc_clear_young (gc);
+	gc->old_num = 0;
+	tn_gc_mark_roots (gc, 0);
+	gc->state = GC_MARK;
+}
+
+/* the stack, scopes and globals are written to without any barrier, so they
+   need to be scanned again before marking can be called done. that's the only
+   part of an incremental collection that isn't split up */
+static void tn_gc_major_finish (struct tn_gc *gc)
+{
+	tn_gc_mark_roots (gc, 0);
+	tn_gc_drain (gc, -1);
+	tn_gc_clear_remembered (gc, 0);
+	tn_gc_clear_young (gc);
+	tn_gc_sweep_all (gc);
+	gc->state = GC_IDLE;
+}
+
+/* fills in the fields that are only worked out when asked for. the values
+   that pages hold on to between a collection and sweeping them count as live */
+struct tn_gc_stats *tn_gc_stats (struct tn_gc *gc)
+{
+	struct timespec now;
+	double secs;
+
+	timespec_get (&now, TIME_UTC);
+	secs = (now.tv_sec - gc->start.tv_sec) + (now.tv_nsec - gc->start.tv_nsec) / 1e9;
+
+	gc->stats.free = gc->stats.pages * GC_PAGE_VALUES - gc->stats.live;
+	gc->stats.alloc_rate = secs > 0 ? gc->stats.allocated / secs : 0;
+
+	return &gc->stats;
+}
+
+// one line per collection, for TRITON_GC_TRACE
+static void tn_gc_trace_cycle (struct tn_gc *gc, const char *kind, uint32_t n, uint32_t us, uint32_t slices)
+{
+	struct tn_gc_stats *st = tn_gc_stats (gc);
+
+	fprintf (stderr, "gc: %s #%u: %uus in %u slice%s, %u old, %u live, %u free, %u pages, %llu payload bytes, %.0f allocs/s\n",
+	         kind, n, us, slices, slices == 1 ? "" : "s",
+	         gc->old_num, st->live, st->free, st->pages, (unsigned long long)st->payload, st->alloc_rate);
+}
+
+/* do the next bit of work. without incremental collection, that's either a
+   minor collection or a whole major one. otherwise, a major collection first
+   sweeps what's left over, and then marks, a slice at a time */
+static void tn_gc_step (struct tn_gc *gc)
+{
+	struct timespec start, end;
+	uint32_t us;
+	int i, minor = 0, major = 0;
+
+	timespec_get (&start, TIME_UTC);
+
+	if (gc->state == GC_MARK) {
+		if (tn_gc_drain (gc, gc->slice)) {
+			tn_gc_major_finish (gc);
+			major = 1;
 		}
 	}
+	else if (gc->state == GC_PREP || (gc->old_num >= gc->major_at && !gc->major_sweep)) {
+		if (gc->state == GC_IDLE)
+			gc->cycle_us = gc->cycle_slices = 0;
+
+		if (!gc->slice) {
+			tn_gc_finish_sweep (gc, -1);
+			tn_gc_major_start (gc);
+			tn_gc_major_finish (gc);
+			major = 1;
+		}
+		else {
+			gc->state = GC_PREP;
+			tn_gc_finish_sweep (gc, gc->slice);
+
+			if (gc->sweep_num == 0)
+				tn_gc_major_start (gc);
+		}
+	}
+	else {
+		tn_gc_minor (gc);
+		tn_gc_check_occupancy (gc);
+		minor = 1;
+	}
+
+	gc->young_num = 0;
+
+	timespec_get (&end, TIME_UTC);
+	us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+	for (i = 0; i < GC_PAUSE_BUCKETS - 1 && us >= (UINT32_C (1) << i); i++);
+	gc->stats.pauses[i]++;
+	gc->stats.pause_total += us;
+
+	if (us > gc->stats.pause_max)
+		gc->stats.pause_max = us;
+
+	if (!minor) {
+		gc->cycle_us += us;
+		gc->cycle_slices++;
+	}
 
-	return gc->free;
+	if (gc->trace && minor)
+		tn_gc_trace_cycle (gc, "minor", gc->stats.minor, us, 1);
+	else if (gc->trace && major)
+		tn_gc_trace_cycle (gc, "major", gc->stats.major, gc->cycle_us, gc->cycle_slices);
 }
 
-struct tn_value *tn_gc_preserve (struct tn_value *val)
+// upper bound of the pct-th percentile pause, in microseconds
+uint32_t tn_gc_pause_percentile (struct tn_gc *gc, int pct)
 {
-	val->flags |= GC_PRESERVE;
-	return val;
+	uint64_t total = 0, n = 0;
+	int i;
+
+	for (i = 0; i < GC_PAUSE_BUCKETS; i++)
+		total += gc->stats.pauses[i];
+
+	for (i = 0; i < GC_PAUSE_BUCKETS; i++) {
+		n += gc->stats.pauses[i];
+
+		if (n * 100 >= total * pct)
+			break;
+	}
+
+	return i < GC_PAUSE_BUCKETS ? UINT32_C (1) << i : UINT32_MAX;
 }
 
-void tn_gc_release (struct tn_value *val)
+/* native code that allocates while holding on to values the VM can't see
+   (values it popped, or new ones it's still building) registers the variables
+   holding them here. the GC reads them whenever it looks at the roots, so they
+   can be reassigned freely. returns what to pass to tn_gc_unroot once done:
+
+	int top = tn_gc_root (vm->gc, &lst);
+	tn_gc_root (vm->gc, &ret);
+	...
+	tn_gc_unroot (vm->gc, top); */
+int tn_gc_root (struct tn_gc *gc, struct tn_value **ref)
 {
-	val->flags &= ~GC_PRESERVE;
+	int top = gc->roots_num;
+
+	array_add (gc->roots, ref);
+	return top;
 }
 
-void tn_gc_release_list (struct tn_value *lst)
+void tn_gc_unroot (struct tn_gc *gc, int top)
 {
-	struct tn_value *it = lst;
+	gc->roots_num = top;
+}
 
-	while (it != &nil) {
-		tn_gc_release (it->data.pair.a);
-		tn_gc_release (it);
-		it = it->data.pair.b;
+/* the heap is as big as it's allowed to get, so collect everything right away
+   and sweep it all, in the hope that it frees up some room */
+static void tn_gc_full (struct tn_gc *gc)
+{
+	if (gc->state == GC_MARK)
+		tn_gc_drain (gc, -1);
+	else {
+		tn_gc_finish_sweep (gc, -1);
+		tn_gc_major_start (gc);
 	}
+
+	tn_gc_major_finish (gc);
+	tn_gc_finish_sweep (gc, -1);
+	gc->young_num = 0;
 }
 
 struct tn_value *tn_gc_alloc (struct tn_gc *gc)
 {
+	struct tn_gc_page *page;
 	struct tn_value *ret;
+	uint64_t free;
+	int i, full = 0;
 
 	if (!gc)
 		return NULL;
 
-	if (!gc->free && (!gc->on || !tn_gc_collect (gc)) && !tn_gc_resize (gc)) {
-		tn_error ("out of memory\n");
-		return NULL;
-	}
+	if (gc->young_num >= (gc->state == GC_IDLE ? GC_NURSERY : GC_SLICE_EVERY))
+		tn_gc_step (gc);
+
+	while (1) {
+		page = gc->cur;
 
-	ret = gc->free;
+		if (page) {
+			for (; page->hint < GC_PAGE_WORDS; page->hint++) {
+				free = ~page->alloc[page->hint] & tn_gc_valid (page->hint);
 
-	gc->free = ret->next;
-	ret->next = gc->used;
-	gc->used = ret;
+				if (free) {
+					i = tn_gc_ctz (free);
+					page->alloc[page->hint] |= UINT64_C (1) << i;
+					ret = &page->values[page->hint * 64 + i];
+					goto found;
+				}
+			}
+		}
+
+		// the current page is full, sweep the next one or find one with room
+		if (gc->sweep_num > 0)
+			gc->cur = tn_gc_sweep_next (gc);
+		else if (gc->avail_num > 0)
+			gc->cur = gc->avail[--gc->avail_num];
+		else if (gc->opts.max && (gc->stats.pages + 1) * GC_PAGE_SIZE > gc->opts.max) {
+			if (full) {
+				tn_error ("heap is full (%zu bytes)\n", gc->opts.max);
+				return NULL;
+			}
+
+			tn_gc_full (gc);
+			full = 1;
+		}
+		else if (!(gc->cur = tn_gc_page_new (gc))) {
+			tn_error ("out of memory\n");
+			return NULL;
+		}
+	}
+
+found:
+	tn_gc_page_young (gc, page);
+	ret->flags = 0;
+	gc->young_num++;
+	gc->stats.live++;
+	gc->stats.allocated++;
+
+	// a major collection is marking, so anything new has to survive it
+	if (gc->state == GC_MARK) {
+		page->mark[page->hint] |= UINT64_C (1) << i;
+		ret->flags = GC_OLD;
+		gc->old_num++;
+		array_add (gc->mark, ret);
+	}
 
 	return ret;
 }
@@ -1,20 +1,133 @@
 #ifndef GC_H__
 #define GC_H__
 
-#define GC_MARKED	1
-#define GC_PRESERVE	2
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "array.h"
+#include "value.h"
+
+#define GC_STATIC	4 // not allocated by the GC at all, see tn_value_const
+#define GC_OLD		8 // survived a collection
+#define GC_REMEMBERED	16 // old value that's in the remembered set
+
+#define GC_NURSERY	4096 // young values allocated between minor collections
+#define GC_SLICE	4096 // default for gc->slice
+#define GC_SLICE_EVERY	256 // values allocated between slices of an incremental collection
+
+// gc->state
+#define GC_IDLE		0
+#define GC_PREP		1 // sweeping what's left before starting a major collection
+#define GC_MARK		2 // marking for a major collection, a slice at a time
+
+// defaults for struct tn_gc_opts
+#define GC_HEAP_INIT	(256 * 1024)
+#define GC_HEAP_GROWTH	3.0
+#define GC_SHRINK_AFTER	8
+#define GC_LOW_OCCUPANCY	0.25 // below this, a minor collection counts towards shrinking the heap
+
+#define GC_PAUSE_BUCKETS	24 // pause times are counted in power of two microsecond buckets
+
+/* the heap is made up of aligned pages, so the page a value lives on can be
+   found from its address. mark bits and such are kept in bitmaps at the start
+   of each page, instead of in the values themselves */
+#define GC_PAGE_SIZE	16384
+#define GC_PAGE_VALUES	((GC_PAGE_SIZE - 512) / sizeof (struct tn_value))
+#define GC_PAGE_WORDS	((GC_PAGE_VALUES + 63) / 64)
+
+#define tn_gc_page(V) ((struct tn_gc_page*)((uintptr_t)(V) & ~(uintptr_t)(GC_PAGE_SIZE - 1)))
+
+struct tn_gc_page {
+	struct tn_gc_page *prev, *next;
+	uint32_t hint; // no free slots in alloc before this word
+	uint8_t young; // in gc->young_pages
+	uint64_t alloc[GC_PAGE_WORDS], mark[GC_PAGE_WORDS], old[GC_PAGE_WORDS];
+	struct tn_value values[GC_PAGE_VALUES];
+};
+
+/* how the heap is sized. any field left at 0 gets its default, and the
+   TRITON_HEAP_INIT, TRITON_HEAP_MAX, TRITON_HEAP_GROWTH and TRITON_HEAP_SHRINK
+   environment variables override these */
+struct tn_gc_opts {
+	size_t init; // bytes of pages to start out with, the heap never shrinks below this
+	size_t max; // bytes the heap can grow to, or 0 for no limit
+
+	/* how much the old generation can grow between major collections, when all
+	   of it survived the last one. when none of it did, it can grow half as
+	   much. higher values trade memory for fewer major collections */
+	double growth;
+
+	/* empty pages are given back to the system once this many minor
+	   collections in a row found the heap less than GC_LOW_OCCUPANCY full */
+	uint32_t shrink_after;
+};
+
+struct tn_gc_stats {
+	uint32_t minor, major; // number of collections of each kind
+	uint32_t mark_peak; // deepest the mark stack has been
+	uint32_t pages; // pages currently allocated
+	uint32_t live; // values allocated and not swept yet
+	uint32_t free; // slots on the current pages that values could go in
+	uint64_t payload; // bytes of string data held outside of the heap
+	uint64_t allocated; // values ever allocated
+	double alloc_rate; // values allocated per second, on average
+	uint64_t pause_total; // microseconds spent collecting
+	uint32_t pause_max;
+	uint32_t pauses[GC_PAUSE_BUCKETS]; // pauses[i] counts pauses under 2^i microseconds
+};
 
 struct tn_gc {
-	struct tn_value *used, *free;
+	struct tn_gc_page *pages;
+	struct tn_gc_page *cur; // page being allocated from
+	array_def (young_pages, struct tn_gc_page*); // pages that might have young values on them
+	array_def (sweep, struct tn_gc_page*); // pages the last collection hasn't swept yet
+	array_def (avail, struct tn_gc_page*); // swept pages with room on them
 	struct tn_vm *vm;
-	uint32_t num_nodes;
-	uint8_t on;
+	uint32_t young_num, old_num, major_at;
+	uint8_t state, major_sweep;
+
+	struct tn_gc_opts opts;
+	uint32_t major_old; // size of the old generation when the last major collection started
+	uint32_t low_cycles; // minor collections in a row with low occupancy
+
+	/* how many values a slice of an incremental major collection marks (or
+	   sweeps). 0 makes major collections stop the world instead */
+	uint32_t slice;
+
+	array_def (rset, struct tn_value*); // old values that might point to young values
+
+	array_def (mark, struct tn_value*); // values that are marked, but not scanned yet
+
+	// C variables holding values that native code is still working on, see tn_gc_root
+	array_def (roots, struct tn_value**);
+	struct tn_gc_stats stats;
+	struct timespec start; // for stats.alloc_rate
+
+	// print a line to stderr after each collection, set by TRITON_GC_TRACE
+	uint8_t trace;
+	uint32_t cycle_us, cycle_slices; // so far, in the current major collection
 };
 
-struct tn_gc *tn_gc_init (struct tn_vm *vm, uint32_t bytes);
-struct tn_value *tn_gc_preserve (struct tn_value *val);
-void tn_gc_release (struct tn_value *val);
-void tn_gc_release_list (struct tn_value *lst);
+struct tn_gc *tn_gc_init (struct tn_vm *vm, const struct tn_gc_opts *opts);
+int tn_gc_root (struct tn_gc *gc, struct tn_value **ref);
+void tn_gc_unroot (struct tn_gc *gc, int top);
 struct tn_value *tn_gc_alloc (struct tn_gc *gc);
+void tn_gc_remember (struct tn_gc *gc, struct tn_value *val);
+void tn_gc_shade (struct tn_gc *gc, struct tn_value *val);
+void tn_gc_touch (struct tn_gc *gc, struct tn_value *obj);
+struct tn_gc_stats *tn_gc_stats (struct tn_gc *gc);
+uint32_t tn_gc_pause_percentile (struct tn_gc *gc, int pct);
+
+// call this after storing val inside of obj
+static inline void tn_gc_barrier (struct tn_gc *gc, struct tn_value *obj, struct tn_value *val)
+{
+	// obj might have been scanned already
+	if (gc->state == GC_MARK)
+		tn_gc_shade (gc, val);
+
+	if ((obj->flags & (GC_OLD | GC_REMEMBERED)) == GC_OLD
+	 && !tn_is_imm (val) && !(val->flags & (GC_OLD | GC_STATIC)))
+		tn_gc_remember (gc, obj);
+}
 
 #endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "error.h"
+#include "intern.h"
+#include "hash.h"
+#include "value.h"
+#include "gc.h"
+#include "vm.h"
+
+// counters that have outgrown an int come back as doubles
+static struct tn_value *tn_gcmod_num (struct tn_vm *vm, uint64_t n)
+{
+	return n <= INT_MAX ? tn_int (vm, n) : tn_double (vm, n);
+}
+
+// gc:live (), gc:minor (), ... each return one field of tn_gc_stats
+#define TN_GCMOD_STAT(NAME, EXPR) \
+	static void tn_gcmod_##NAME (struct tn_vm *vm, int argn) \
+	{ \
+		struct tn_gc_stats *st = tn_gc_stats (vm->gc); \
+	\
+		if (argn != 0) { \
+			tn_error ("gc:" #NAME " takes no arguments\n"); \
+			vm->sp -= argn; \
+			tn_vm_push (vm, &nil); \
+			return; \
+		} \
+	\
+		tn_vm_push (vm, EXPR); \
+	}
+
+TN_GCMOD_STAT (live, tn_gcmod_num (vm, st->live))
+TN_GCMOD_STAT (free, tn_gcmod_num (vm, st->free))
+TN_GCMOD_STAT (pages, tn_gcmod_num (vm, st->pages))
+TN_GCMOD_STAT (payload, tn_gcmod_num (vm, st->payload))
+TN_GCMOD_STAT (allocated, tn_gcmod_num (vm, st->allocated))
+TN_GCMOD_STAT (alloc_rate, tn_double (vm, st->alloc_rate))
+TN_GCMOD_STAT (minor, tn_gcmod_num (vm, st->minor))
+TN_GCMOD_STAT (major, tn_gcmod_num (vm, st->major))
+TN_GCMOD_STAT (pause_total, tn_gcmod_num (vm, st->pause_total))
+TN_GCMOD_STAT (pause_max, tn_gcmod_num (vm, st->pause_max))
+
+// gc:pause (pct) == upper bound of the pct-th percentile pause, in microseconds
+static void tn_gcmod_pause (struct tn_vm *vm, int argn)
+{
+	int pct;
+
+	if (argn != 1 || tn_value_get_args (vm, "i", &pct) || pct < 0 || pct > 100) {
+		tn_error ("invalid argument passed to gc:pause\n");
+		tn_vm_push (vm, &nil);
+		return;
+	}
+
+	tn_vm_push (vm, tn_gcmod_num (vm, tn_gc_pause_percentile (vm->gc, pct)));
+}
+
+struct tn_hash *tn_gc_module (struct tn_vm *vm)
+{
+	struct tn_hash *ret = tn_hash_new (16);
+
+	tn_hash_insert (ret, tn_intern ("live"), tn_cfun_const (tn_gcmod_live));
+	tn_hash_insert (ret, tn_intern ("free"), tn_cfun_const (tn_gcmod_free));
+	tn_hash_insert (ret, tn_intern ("pages"), tn_cfun_const (tn_gcmod_pages));
+	tn_hash_insert (ret, tn_intern ("payload"), tn_cfun_const (tn_gcmod_payload));
+	tn_hash_insert (ret, tn_intern ("allocated"), tn_cfun_const (tn_gcmod_allocated));
+	tn_hash_insert (ret, tn_intern ("alloc_rate"), tn_cfun_const (tn_gcmod_alloc_rate));
+	tn_hash_insert (ret, tn_intern ("minor"), tn_cfun_const (tn_gcmod_minor));
+	tn_hash_insert (ret, tn_intern ("major"), tn_cfun_const (tn_gcmod_major));
+	tn_hash_insert (ret, tn_intern ("pause_total"), tn_cfun_const (tn_gcmod_pause_total));
+	tn_hash_insert (ret, tn_intern ("pause_max"), tn_cfun_const (tn_gcmod_pause_max));
+	tn_hash_insert (ret, tn_intern ("pause"), tn_cfun_const (tn_gcmod_pause));
+
+	return ret;
+}
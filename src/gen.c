@@ -2,16 +2,31 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <libgen.h>
 
 #include "error.h"
 #include "hash.h"
+#include "intern.h"
+#include "arena.h"
 #include "lexer.h"
 #include "parser.h"
 #include "opcode.h"
 #include "gen.h"
+#include "decode.h"
 #include "vm.h"
 
+#define TN_GEN_STRMAX 0xffff // longest string the byte code can hold
+#define TN_GEN_PROPMAX 32 // longest string constant that gets copied into every use
+
+static int tn_gen_opt = 2;
+
+// 0 compiles the syntax tree as it is, 1 folds constants first, 2 also runs the peephole pass
+void tn_gen_set_opt (int level)
+{
+	tn_gen_opt = level;
+}
+
 // turn string identifiers into numbers
 static uint32_t tn_gen_id_num (struct tn_chunk *ch, const char *name, int set)
 {
@@ -22,6 +37,7 @@ static uint32_t tn_gen_id_num (struct tn_chunk *ch, const char *name, int set)
 	if (id || !set)
 		return id;
 	else {
+		// names are interned, so they already outlive the syntax tree
 		id = ++ch->vars->maxid;
 		if (tn_hash_insert (ch->vars->hash, name, (void*)(intptr_t)id))
 			return 0;
@@ -32,14 +48,15 @@ static uint32_t tn_gen_id_num (struct tn_chunk *ch, const char *name, int set)
 static void tn_gen_emit8 (struct tn_chunk *ch, uint8_t n)
 {
 	if (ch->pc >= ch->codelen) {
-		uint8_t *code = ch->code;
+		uint8_t *code = tn_arena_realloc (ch->arena, ch->code, ch->codelen, ch->codelen * 2);
 
-		ch->code = realloc (ch->code, ch->codelen *= 2);
-		if (!ch->code) {
+		if (!code) {
 			tn_error ("realloc failed\n");
-			ch->code = code; // pretend like nothing happened I guess
-			return;
+			return; // pretend like nothing happened I guess
 		}
+
+		ch->code = code;
+		ch->codelen *= 2;
 	}
 
 	ch->code[ch->pc++] = n;
@@ -87,22 +104,27 @@ static void tn_gen_emitpos (struct tn_chunk *ch, uint32_t n, uint32_t pos)
 	ch->code[pos++] = (n & 0xff000000) >> 24;
 }
 
-static void tn_gen_ident (struct tn_chunk *ch, const char *name)
+// finds the innermost binding of name, and how many frames up it is
+static uint32_t tn_gen_resolve (struct tn_chunk *ch, const char *name, uint32_t *frame)
 {
-	struct tn_chunk *it = ch;
-	uint32_t id, frame = 0;
+	uint32_t id;
 
-	while (it) {
-		id = tn_gen_id_num (it, name, 0);
-		if (id != 0) {
-			tn_gen_emit8 (ch, OP_PSHV);
-			tn_gen_emit16 (ch, frame); // how many frames up we need to go to find a binding
-			tn_gen_emit32 (ch, id);
-			return;
-		}
+	for (*frame = 0; ch; ch = ch->next, (*frame)++)
+		if ((id = tn_gen_id_num (ch, name, 0)))
+			return id;
 
-		frame++;
-		it = it->next;
+	return 0;
+}
+
+static void tn_gen_ident (struct tn_chunk *ch, const char *name)
+{
+	uint32_t id, frame;
+
+	if ((id = tn_gen_resolve (ch, name, &frame))) {
+		tn_gen_emit8 (ch, OP_PSHV);
+		tn_gen_emit16 (ch, frame); // how many frames up we need to go to find a binding
+		tn_gen_emit32 (ch, id);
+		return;
 	}
 
 	// this is either a global or unbound
@@ -138,6 +160,58 @@ static uint8_t bop_opcodes[] = {
 };
 #undef op
 
+static inline int tn_gen_fold_const (struct tn_expr *ex);
+static inline int tn_gen_fold_true (struct tn_expr *ex);
+
+/* makes the bindings compiling ex would, without emitting any of it. folding
+   leaves code it can't prove dead to here when it binds names, since dropping
+   it would change what later references in the chunk (closures especially)
+   resolve to */
+static void tn_gen_bind (struct tn_chunk *ch, struct tn_expr *ex)
+{
+	uint32_t frame;
+
+	for (; ex; ex = ex->next) {
+		switch (ex->type) {
+			case EXPR_IDENT:
+				if (!tn_gen_resolve (ch, ex->data.id, &frame))
+					tn_gen_id_num (ch, ex->data.id, 1);
+				break;
+			case EXPR_ASSN:
+				tn_gen_id_num (ch, ex->data.assn.name, 1);
+				tn_gen_bind (ch, ex->data.assn.expr);
+				break;
+			case EXPR_IMPT:
+				tn_gen_id_num (ch, ex->data.s, 1);
+				break;
+			case EXPR_UOP:
+				tn_gen_bind (ch, ex->data.uop.expr);
+				break;
+			case EXPR_BOP:
+				tn_gen_bind (ch, ex->data.bop.left);
+				tn_gen_bind (ch, ex->data.bop.right);
+				break;
+			case EXPR_CALL:
+				tn_gen_bind (ch, ex->data.call.args);
+				tn_gen_bind (ch, ex->data.call.fn);
+				break;
+			case EXPR_IF:
+				tn_gen_bind (ch, ex->data.ifs.cond);
+				tn_gen_bind (ch, ex->data.ifs.t);
+				tn_gen_bind (ch, ex->data.ifs.f);
+				break;
+			case EXPR_ACCS:
+				tn_gen_bind (ch, ex->data.accs.expr);
+				break;
+			case EXPR_DO:
+			case EXPR_LIST:
+				tn_gen_bind (ch, ex->data.expr);
+				break;
+			default: break; // functions bind in their own chunks
+		}
+	}
+}
+
 static void tn_gen_expr (struct tn_chunk *ch, struct tn_expr *ex, int final)
 {
 	uint32_t id;
@@ -172,7 +246,7 @@ static void tn_gen_expr (struct tn_chunk *ch, struct tn_expr *ex, int final)
 		case EXPR_FN: {
 			struct tn_chunk *new;
 
-			new = tn_gen_compile (ex->data.fn.expr, &ex->data.fn, ch, NULL);
+			new = tn_gen_compile (ch->arena, ex->data.fn.expr, &ex->data.fn, ch, NULL);
 			array_add (ch->subch, new);
 
 			tn_gen_emit8 (ch, OP_CLSR);
@@ -185,7 +259,14 @@ static void tn_gen_expr (struct tn_chunk *ch, struct tn_expr *ex, int final)
 			break;
 		case EXPR_BOP:
 			// && and || require some flow control
-			if (ex->data.bop.op == TOK_ANDL || ex->data.bop.op == TOK_ORL) {
+			if ((ex->data.bop.op == TOK_ANDL || ex->data.bop.op == TOK_ORL) && tn_gen_opt >= 1
+			    && tn_gen_fold_const (ex->data.bop.left) && tn_gen_fold_true (ex->data.bop.left) == (ex->data.bop.op == TOK_ORL)) {
+				// folding left the right side for its bindings, see tn_gen_bind
+				tn_gen_bind (ch, ex->data.bop.right);
+				tn_gen_emit8 (ch, OP_PSHI);
+				tn_gen_emit32 (ch, ex->data.bop.op == TOK_ORL);
+			}
+			else if (ex->data.bop.op == TOK_ANDL || ex->data.bop.op == TOK_ORL) {
 				uint32_t j1, j2, out;
 
 				tn_gen_expr (ch, ex->data.bop.left, 0);
@@ -241,6 +322,23 @@ static void tn_gen_expr (struct tn_chunk *ch, struct tn_expr *ex, int final)
 		case EXPR_IF: {
 			uint32_t tskip, fskip; // we need to save positions for jump addresses
 
+			// folding left the dead branch for its bindings, see tn_gen_bind. they're made in the order they'd be compiled in
+			if (tn_gen_opt >= 1 && tn_gen_fold_const (ex->data.ifs.cond)) {
+				if (tn_gen_fold_true (ex->data.ifs.cond)) {
+					tn_gen_expr (ch, ex->data.ifs.t, final);
+					tn_gen_bind (ch, ex->data.ifs.f);
+				}
+				else {
+					tn_gen_bind (ch, ex->data.ifs.t);
+
+					if (ex->data.ifs.f)
+						tn_gen_expr (ch, ex->data.ifs.f, final);
+					else
+						tn_gen_emit8 (ch, OP_NIL);
+				}
+				break;
+			}
+
 			tn_gen_expr (ch, ex->data.ifs.cond, 0);
 			tn_gen_emit8 (ch, OP_JZ);
 			tskip = ch->pc;
@@ -306,7 +404,801 @@ static void tn_gen_expr (struct tn_chunk *ch, struct tn_expr *ex, int final)
 	}
 }
 
-struct tn_chunk *tn_gen_compile (struct tn_expr *ex, struct tn_expr_data_fn *fn,
+/* constant folding works on the syntax tree, in place, before any of it is
+   compiled. besides literal arithmetic, comparisons, concatenation and if
+   conditions, variables that are bound once in a function, by an assignment
+   of a constant at the top level of its body, are replaced by that constant
+   everywhere after it, including in the functions nested inside. a name that
+   any of those functions binds again is left alone in them, as is everything
+   with more than one binding (arguments and imports count as two), since code
+   could see either */
+struct tn_gen_fold_scope {
+	int open; // later code can assign these variables too, like the lines of the REPL
+	struct tn_gen_fold_var *vars;
+};
+
+struct tn_gen_fold_var {
+	const char *name;
+	int binds;
+	struct tn_expr *val; // once the assignment has been folded
+	struct tn_gen_fold_scope *scope; // function it's bound in
+	struct tn_gen_fold_var *shadows, *next; // next in the same scope
+};
+
+// the innermost binding of each name is kept in its tn_intern_bind while the pass runs
+struct tn_gen_fold {
+	struct tn_arena *arena;
+	struct tn_gen_fold_scope *sc; // function being folded
+	struct tn_gen_fold_var *free; // from scopes that have been left, for reuse
+	int broken; // a binding couldn't be allocated, so nothing can be assumed about any name
+};
+
+static void tn_gen_fold_expr (struct tn_gen_fold *f, struct tn_expr *ex);
+static void tn_gen_fold_body (struct tn_gen_fold *f, struct tn_expr *ex);
+
+static void tn_gen_fold_bind (struct tn_gen_fold *f, const char *name, int n)
+{
+	struct tn_gen_fold_var *var = tn_intern_bind (name), *new;
+
+	if (var && var->scope == f->sc) {
+		var->binds += n;
+		return;
+	}
+
+	if (f->free) {
+		new = f->free;
+		f->free = new->next;
+	}
+	else if (!(new = tn_arena_alloc (f->arena, sizeof (*new)))) {
+		f->broken = 1;
+		return;
+	}
+
+	tn_intern_bind (name) = new;
+	new->name = name;
+	new->binds = n;
+	new->val = NULL;
+	new->scope = f->sc;
+	new->shadows = var;
+	new->next = f->sc->vars;
+	f->sc->vars = new;
+}
+
+// counts the bindings in ex, which can be a list, leaving nested functions to themselves
+static void tn_gen_fold_count (struct tn_gen_fold *f, struct tn_expr *ex)
+{
+	for (; ex; ex = ex->next) {
+		switch (ex->type) {
+			case EXPR_ASSN:
+				tn_gen_fold_bind (f, ex->data.assn.name, 1);
+				tn_gen_fold_count (f, ex->data.assn.expr);
+				break;
+			case EXPR_IMPT:
+				tn_gen_fold_bind (f, ex->data.s, 2);
+				break;
+			case EXPR_UOP:
+				tn_gen_fold_count (f, ex->data.uop.expr);
+				break;
+			case EXPR_BOP:
+				tn_gen_fold_count (f, ex->data.bop.left);
+				tn_gen_fold_count (f, ex->data.bop.right);
+				break;
+			case EXPR_CALL:
+				tn_gen_fold_count (f, ex->data.call.fn);
+				tn_gen_fold_count (f, ex->data.call.args);
+				break;
+			case EXPR_IF:
+				tn_gen_fold_count (f, ex->data.ifs.cond);
+				tn_gen_fold_count (f, ex->data.ifs.t);
+				tn_gen_fold_count (f, ex->data.ifs.f);
+				break;
+			case EXPR_ACCS:
+				tn_gen_fold_count (f, ex->data.accs.expr);
+				break;
+			case EXPR_DO:
+			case EXPR_LIST:
+				tn_gen_fold_count (f, ex->data.expr);
+				break;
+			default: break;
+		}
+	}
+}
+
+static struct tn_expr *tn_gen_fold_lookup (struct tn_gen_fold *f, const char *name)
+{
+	struct tn_gen_fold_var *var;
+
+	if (f->broken || !(var = tn_intern_bind (name)))
+		return NULL; // a global, or unbound
+
+	return var->binds == 1 && (var->scope == f->sc || !var->scope->open) ? var->val : NULL;
+}
+
+static inline int tn_gen_fold_const (struct tn_expr *ex)
+{
+	return ex && (ex->type == EXPR_INT || ex->type == EXPR_FLOAT || ex->type == EXPR_STRING || ex->type == EXPR_NIL);
+}
+
+// tn_value_true for a constant
+static inline int tn_gen_fold_true (struct tn_expr *ex)
+{
+	return ex->type == EXPR_INT && ex->data.i;
+}
+
+// replaces ex with a copy of from, keeping its place in whatever list it's in
+static void tn_gen_fold_copy (struct tn_expr *ex, struct tn_expr *from)
+{
+	struct tn_expr *next = ex->next;
+
+	*ex = *from;
+	ex->next = next;
+}
+
+static void tn_gen_fold_uop (struct tn_expr *ex)
+{
+	struct tn_expr *e = ex->data.uop.expr;
+
+	if (ex->data.uop.op == TOK_EXCL && tn_gen_fold_const (e)) {
+		ex->type = EXPR_INT;
+		ex->data.i = !tn_gen_fold_true (e);
+	}
+	else if (ex->data.uop.op == TOK_SUB && e->type == EXPR_INT && e->data.i != INT_MIN) {
+		ex->type = EXPR_INT;
+		ex->data.i = -e->data.i;
+	}
+	else if (ex->data.uop.op == TOK_SUB && e->type == EXPR_FLOAT) {
+		ex->type = EXPR_FLOAT;
+		ex->data.d = -e->data.d;
+	}
+}
+
+/* whether compiling ex, which can be a list, could bind a name in the chunk.
+   code that could isn't dropped, but left for tn_gen_expr, which doesn't emit
+   it but still makes its bindings */
+static int tn_gen_fold_binds (struct tn_expr *ex)
+{
+	for (; ex; ex = ex->next) {
+		switch (ex->type) {
+			case EXPR_IDENT: case EXPR_ASSN: case EXPR_IMPT:
+				return 1;
+			case EXPR_UOP:
+				if (tn_gen_fold_binds (ex->data.uop.expr))
+					return 1;
+				break;
+			case EXPR_BOP:
+				if (tn_gen_fold_binds (ex->data.bop.left) || tn_gen_fold_binds (ex->data.bop.right))
+					return 1;
+				break;
+			case EXPR_CALL:
+				if (tn_gen_fold_binds (ex->data.call.fn) || tn_gen_fold_binds (ex->data.call.args))
+					return 1;
+				break;
+			case EXPR_IF:
+				if (tn_gen_fold_binds (ex->data.ifs.cond) || tn_gen_fold_binds (ex->data.ifs.t) || tn_gen_fold_binds (ex->data.ifs.f))
+					return 1;
+				break;
+			case EXPR_ACCS:
+				if (tn_gen_fold_binds (ex->data.accs.expr))
+					return 1;
+				break;
+			case EXPR_DO:
+			case EXPR_LIST:
+				if (tn_gen_fold_binds (ex->data.expr))
+					return 1;
+				break;
+			default: break;
+		}
+	}
+
+	return 0;
+}
+
+/* follows the vm: ints stay ints unless they'd overflow or divide by zero,
+   which is left to happen at run time, and anything involving a double is a
+   double, comparisons included */
+static void tn_gen_fold_bop (struct tn_expr *ex)
+{
+	int op = ex->data.bop.op;
+	struct tn_expr *l = ex->data.bop.left, *r = ex->data.bop.right;
+
+	if (op == TOK_ANDL || op == TOK_ORL) {
+		if (!tn_gen_fold_const (l))
+			return;
+
+		// the right side isn't evaluated if the left decides it
+		if (tn_gen_fold_true (l) == (op == TOK_ORL) && tn_gen_fold_binds (r))
+			return;
+		else if (tn_gen_fold_true (l) == (op == TOK_ORL))
+			ex->data.i = op == TOK_ORL;
+		else if (tn_gen_fold_const (r))
+			ex->data.i = tn_gen_fold_true (r);
+		else
+			return;
+
+		ex->type = EXPR_INT;
+	}
+	else if (l->type == EXPR_INT && r->type == EXPR_INT) {
+		long long a = l->data.i, b = r->data.i, v;
+
+		switch (op) {
+			case TOK_ADD: v = a + b; break;
+			case TOK_SUB: v = a - b; break;
+			case TOK_MUL: v = a * b; break;
+			case TOK_DIV: if (!b) return; v = a / b; break;
+			case TOK_MOD: if (!b) return; v = a % b; break;
+			case TOK_EQ: v = a == b; break;
+			case TOK_NEQ: v = a != b; break;
+			case TOK_LT: v = a < b; break;
+			case TOK_LTE: v = a <= b; break;
+			case TOK_GT: v = a > b; break;
+			case TOK_GTE: v = a >= b; break;
+			default: return;
+		}
+
+		if (v < INT_MIN || v > INT_MAX)
+			return;
+
+		ex->type = EXPR_INT;
+		ex->data.i = v;
+	}
+	else if ((l->type == EXPR_INT || l->type == EXPR_FLOAT) && (r->type == EXPR_INT || r->type == EXPR_FLOAT)) {
+		double a = l->type == EXPR_INT ? l->data.i : l->data.d, b = r->type == EXPR_INT ? r->data.i : r->data.d, v;
+
+		switch (op) {
+			case TOK_ADD: v = a + b; break;
+			case TOK_SUB: v = a - b; break;
+			case TOK_MUL: v = a * b; break;
+			case TOK_DIV: v = a / b; break;
+			case TOK_EQ: v = a == b; break;
+			case TOK_NEQ: v = a != b; break;
+			case TOK_LT: v = a < b; break;
+			case TOK_LTE: v = a <= b; break;
+			case TOK_GT: v = a > b; break;
+			case TOK_GTE: v = a >= b; break;
+			default: return; // % is ints only
+		}
+
+		ex->type = EXPR_FLOAT;
+		ex->data.d = v;
+	}
+}
+
+/* concatenation is right associative, so a chain of it runs down the right
+   hand side. the whole chain is handled at once, so that runs of strings in it
+   are joined in one go rather than a level at a time, which would be quadratic */
+static void tn_gen_fold_cat (struct tn_gen_fold *f, struct tn_expr *ex)
+{
+	struct tn_expr *it, **nodes, **ops;
+	int n = 0, m, i, j, k;
+	size_t len;
+	char *s;
+
+	for (it = ex; it->type == EXPR_BOP && it->data.bop.op == TOK_CAT; it = it->data.bop.right)
+		n++;
+
+	// n operators, n + 1 operands
+	if (!(nodes = tn_arena_alloc (f->arena, (2 * n + 1) * sizeof (*nodes))))
+		return;
+
+	ops = nodes + n;
+
+	for (i = 0, it = ex; i < n; i++, it = it->data.bop.right) {
+		nodes[i] = it;
+		ops[i] = it->data.bop.left;
+		tn_gen_fold_expr (f, ops[i]);
+	}
+
+	ops[n] = it;
+	tn_gen_fold_expr (f, ops[n]);
+
+	for (i = m = 0; i <= n; i = j) {
+		j = i + 1;
+
+		if (ops[i]->type == EXPR_STRING) {
+			for (len = strlen (ops[i]->data.s); j <= n && ops[j]->type == EXPR_STRING; j++) {
+				if (len + strlen (ops[j]->data.s) > TN_GEN_STRMAX)
+					break;
+
+				len += strlen (ops[j]->data.s);
+			}
+
+			if (j - i > 1 && !(s = tn_arena_alloc (f->arena, len + 1)))
+				j = i + 1;
+			else if (j - i > 1) {
+				for (k = i, len = 0; k < j; k++) {
+					strcpy (s + len, ops[k]->data.s);
+					len += strlen (ops[k]->data.s);
+				}
+
+				ops[i]->data.s = s;
+			}
+		}
+
+		ops[m++] = ops[i];
+	}
+
+	if (m == n + 1)
+		return;
+
+	if (m == 1) {
+		tn_gen_fold_copy (ex, ops[0]);
+		return;
+	}
+
+	for (i = 0; i < m - 1; i++) {
+		nodes[i]->data.bop.left = ops[i];
+		nodes[i]->data.bop.right = i < m - 2 ? nodes[i + 1] : ops[m - 1];
+	}
+}
+
+// folds the body of ex with the bindings it makes in scope, then puts back the ones they shadowed
+static void tn_gen_fold_scope (struct tn_gen_fold *f, struct tn_expr *ex, struct tn_expr_data_fn *fn, int open)
+{
+	int i;
+	struct tn_gen_fold_var *it, *next;
+	struct tn_gen_fold_scope sc = { open, NULL }, *up = f->sc;
+
+	f->sc = &sc;
+
+	for (i = 0; fn && i < fn->args_num; i++)
+		tn_gen_fold_bind (f, fn->args[i], 2);
+
+	tn_gen_fold_count (f, ex);
+	tn_gen_fold_body (f, ex);
+
+	for (it = sc.vars; it; it = next) {
+		next = it->next;
+		tn_intern_bind (it->name) = it->shadows;
+		it->next = f->free;
+		f->free = it;
+	}
+
+	f->sc = up;
+}
+
+static void tn_gen_fold_list (struct tn_gen_fold *f, struct tn_expr *ex)
+{
+	for (; ex; ex = ex->next)
+		tn_gen_fold_expr (f, ex);
+}
+
+static void tn_gen_fold_expr (struct tn_gen_fold *f, struct tn_expr *ex)
+{
+	struct tn_expr *val;
+
+	if (!ex)
+		return;
+
+	switch (ex->type) {
+		case EXPR_IDENT:
+			if ((val = tn_gen_fold_lookup (f, ex->data.id)))
+				tn_gen_fold_copy (ex, val);
+			break;
+		case EXPR_ASSN:
+			tn_gen_fold_expr (f, ex->data.assn.expr);
+			break;
+		case EXPR_FN:
+			tn_gen_fold_scope (f, ex->data.fn.expr, &ex->data.fn, 0);
+			break;
+		case EXPR_UOP:
+			tn_gen_fold_expr (f, ex->data.uop.expr);
+			tn_gen_fold_uop (ex);
+			break;
+		case EXPR_BOP:
+			if (ex->data.bop.op == TOK_CAT) {
+				tn_gen_fold_cat (f, ex);
+				break;
+			}
+
+			tn_gen_fold_expr (f, ex->data.bop.left);
+			tn_gen_fold_expr (f, ex->data.bop.right);
+			tn_gen_fold_bop (ex);
+			break;
+		case EXPR_CALL:
+			tn_gen_fold_expr (f, ex->data.call.fn);
+			tn_gen_fold_list (f, ex->data.call.args);
+			break;
+		case EXPR_IF:
+			tn_gen_fold_expr (f, ex->data.ifs.cond);
+			tn_gen_fold_expr (f, ex->data.ifs.t);
+			tn_gen_fold_expr (f, ex->data.ifs.f);
+
+			if (!tn_gen_fold_const (ex->data.ifs.cond)
+			    || tn_gen_fold_binds (tn_gen_fold_true (ex->data.ifs.cond) ? ex->data.ifs.f : ex->data.ifs.t))
+				break;
+
+			if ((val = tn_gen_fold_true (ex->data.ifs.cond) ? ex->data.ifs.t : ex->data.ifs.f))
+				tn_gen_fold_copy (ex, val);
+			else {
+				ex->type = EXPR_NIL;
+				ex->data.nil = NULL;
+			}
+			break;
+		case EXPR_ACCS:
+			tn_gen_fold_expr (f, ex->data.accs.expr);
+			break;
+		case EXPR_DO:
+		case EXPR_LIST:
+			tn_gen_fold_list (f, ex->data.expr);
+			break;
+		default: break;
+	}
+}
+
+static void tn_gen_fold_body (struct tn_gen_fold *f, struct tn_expr *ex)
+{
+	struct tn_gen_fold_var *var;
+	struct tn_expr *val;
+
+	for (; ex; ex = ex->next) {
+		tn_gen_fold_expr (f, ex);
+
+		if (ex->type != EXPR_ASSN)
+			continue;
+
+		val = ex->data.assn.expr;
+
+		if (tn_gen_fold_const (val) && (val->type != EXPR_STRING || strlen (val->data.s) <= TN_GEN_PROPMAX)
+		    && (var = tn_intern_bind (ex->data.assn.name)) && var->scope == f->sc && var->binds == 1)
+			var->val = val;
+	}
+}
+
+/* folds the body ex, as parsed, before it's compiled. anything it allocates
+   comes from arena, which has to last until then. open is for code whose
+   variables can be assigned again by code loaded later on */
+void tn_gen_fold (struct tn_arena *arena, struct tn_expr *ex, int open)
+{
+	struct tn_gen_fold f = { arena, NULL, NULL, 0 };
+
+	if (tn_gen_opt >= 1)
+		tn_gen_fold_scope (&f, ex, NULL, open);
+}
+
+/* the peephole pass goes over the finished byte code of a chunk, as one record
+   per instruction. jumps are threaded through other jumps and through pushes
+   of a constant that's tested straight away, a comparison tested by OP_JZ
+   becomes one of the fused OP_*JZ instructions, and a test of OP_NOT tests its
+   operand the other way round. pushes that are dropped, jumps to the next
+   instruction and code that can't be reached are removed, and so are the
+   OP_SETs of a function's variables that nothing reads, like the one after
+   every OP_GLOB. a removed instruction passes the jumps landing on it to the
+   next one left, and the result is written back over the old code, which it
+   never outgrows */
+struct tn_gen_peep {
+	uint32_t pc; // where it was in the old code
+	uint32_t target; // record a jump goes to
+	uint32_t refs; // jumps landing here
+	uint8_t op, dead;
+};
+
+static uint32_t tn_gen_read16 (const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t tn_gen_read32 (const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// how many bytes the instruction at p takes up, see tn_decode_skip
+static uint32_t tn_gen_insn_len (const uint8_t *p)
+{
+	switch (*p) {
+		case OP_PSHI: case OP_SET: case OP_JMP: case OP_JNZ:
+		case OP_JZ: case OP_CALL: case OP_TCAL: case OP_EQJZ: case OP_NEQJZ:
+		case OP_LTJZ: case OP_LTEJZ: case OP_GTJZ: case OP_GTEJZ:
+			return 5;
+		case OP_PSHD: return 9;
+		case OP_PSHV: return 7;
+		case OP_CLSR: return 3;
+		case OP_ARGS: return 6;
+		case OP_PSHS: case OP_GLOB: case OP_ACCS: case OP_IMPT:
+			return 3 + tn_gen_read16 (p + 1);
+		default: return 1;
+	}
+}
+
+static inline int tn_gen_peep_jump (uint8_t op)
+{
+	return op == OP_JMP || op == OP_JZ || op == OP_JNZ || (op >= OP_EQJZ && op <= OP_GTEJZ);
+}
+
+// the record of the instruction at pc
+static uint32_t tn_gen_peep_find (struct tn_gen_peep *r, uint32_t n, uint32_t pc)
+{
+	uint32_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (r[mid].pc < pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static inline uint32_t tn_gen_peep_live (struct tn_gen_peep *r, uint32_t i)
+{
+	while (r[i].dead) // the record after the last one never is
+		i++;
+
+	return i;
+}
+
+static void tn_gen_peep_kill (struct tn_gen_peep *r, uint32_t i)
+{
+	r[i].dead = 1;
+
+	if (tn_gen_peep_jump (r[i].op))
+		r[tn_gen_peep_live (r, r[i].target)].refs--;
+
+	r[tn_gen_peep_live (r, i + 1)].refs += r[i].refs;
+	r[i].refs = 0;
+}
+
+static void tn_gen_peep_retarget (struct tn_gen_peep *r, uint32_t i, uint32_t target)
+{
+	r[tn_gen_peep_live (r, r[i].target)].refs--;
+	r[i].target = target;
+	r[tn_gen_peep_live (r, target)].refs++;
+}
+
+// where the OP_JZ or OP_JNZ at i goes, after the OP_PSHI before it
+static uint32_t tn_gen_peep_branch (struct tn_chunk *ch, struct tn_gen_peep *r, uint32_t pshi, uint32_t i)
+{
+	int zero = tn_gen_read32 (ch->code + r[pshi].pc + 1) == 0;
+	return (r[i].op == OP_JZ) == zero ? r[i].target : i + 1;
+}
+
+// the instruction a jump to i ends up at, with a limit for jumps that go round in circles
+static uint32_t tn_gen_peep_thread (struct tn_chunk *ch, struct tn_gen_peep *r, uint32_t i)
+{
+	int n;
+	uint32_t next;
+
+	for (n = 0; n < 16; n++) {
+		i = tn_gen_peep_live (r, i);
+		next = tn_gen_peep_live (r, i + 1);
+
+		if (r[i].op == OP_JMP)
+			i = r[i].target;
+		else if (r[i].op == OP_PSHI && (r[next].op == OP_JZ || r[next].op == OP_JNZ))
+			i = tn_gen_peep_branch (ch, r, i, next);
+		else
+			break;
+	}
+
+	return tn_gen_peep_live (r, i);
+}
+
+// marks the variables of the function depth levels out from ch that ch and its sub-chunks read
+static void tn_gen_peep_reads (struct tn_chunk *ch, uint32_t depth, uint8_t *read, uint32_t maxid)
+{
+	int i;
+	uint32_t pc, id;
+
+	for (pc = 0; pc < ch->pc; pc += tn_gen_insn_len (ch->code + pc)) {
+		if (ch->code[pc] == OP_PSHV && tn_gen_read16 (ch->code + pc + 1) == depth) {
+			id = tn_gen_read32 (ch->code + pc + 3);
+			if (id <= maxid)
+				read[id] = 1;
+		}
+	}
+
+	for (i = 0; i < ch->subch_num; i++) {
+		if (ch->subch[i])
+			tn_gen_peep_reads (ch->subch[i], depth + 1, read, maxid);
+	}
+}
+
+// fn is set for the body of a function, whose variables can't be seen from anywhere else
+static void tn_gen_peephole (struct tn_chunk *ch, int fn)
+{
+	struct tn_gen_peep *r, *new;
+	uint32_t *at = NULL, i, j, n, size, pc, len = ch->pc;
+	uint8_t *read = NULL;
+	int changed, any = 0;
+
+	size = len / 4 + 2; // about right for most code, it grows if not
+	r = malloc (size * sizeof (*r));
+
+	if (fn)
+		read = calloc (ch->vars->maxid + 1, 1);
+
+	if (!r || (fn && !read))
+		goto error;
+
+	for (n = 0, pc = 0; pc < len; n++) {
+		if (n + 1 == size) {
+			if (!(new = realloc (r, (size *= 2) * sizeof (*r))))
+				goto error;
+			r = new;
+		}
+
+		r[n] = (struct tn_gen_peep) { .pc = pc, .op = ch->code[pc] };
+
+		// the variables read by sub-chunks are done below
+		if (fn && r[n].op == OP_PSHV && tn_gen_read16 (ch->code + pc + 1) == 0)
+			read[tn_gen_read32 (ch->code + pc + 3)] = 1;
+
+		pc += tn_gen_insn_len (ch->code + pc);
+	}
+
+	r[n] = (struct tn_gen_peep) { .pc = len, .op = OP_END };
+
+	for (i = 0; i < n; i++) {
+		if (tn_gen_peep_jump (r[i].op)) {
+			r[i].target = tn_gen_peep_find (r, n, tn_gen_read32 (ch->code + r[i].pc + 1));
+			r[r[i].target].refs++;
+		}
+	}
+
+	for (i = 0; fn && i < ch->subch_num; i++) {
+		if (ch->subch[i])
+			tn_gen_peep_reads (ch->subch[i], 1, read, ch->vars->maxid);
+	}
+
+	do {
+		changed = 0;
+
+		for (i = tn_gen_peep_live (r, 0); i < n; i = tn_gen_peep_live (r, i + 1)) {
+			if (tn_gen_peep_jump (r[i].op)) {
+				uint32_t to = tn_gen_peep_thread (ch, r, r[i].target);
+
+				if (to != tn_gen_peep_live (r, r[i].target)) {
+					tn_gen_peep_retarget (r, i, to);
+					changed = 1;
+				}
+
+				if (r[i].op == OP_JMP && r[to].op == OP_RET) {
+					r[to].refs--;
+					r[i].op = OP_RET;
+					changed = 1;
+				}
+			}
+
+			j = tn_gen_peep_live (r, i + 1);
+
+			switch (r[i].op) {
+				case OP_JMP:
+					if (tn_gen_peep_live (r, r[i].target) == j) {
+						tn_gen_peep_kill (r, i);
+						changed = 1;
+						break;
+					}
+					// fall through
+				case OP_RET:
+					// nothing jumps to what follows, so it's never run
+					for (; j < n && !r[j].refs; j = tn_gen_peep_live (r, j + 1)) {
+						tn_gen_peep_kill (r, j);
+						changed = 1;
+					}
+					break;
+				case OP_JZ:
+				case OP_JNZ:
+					if (tn_gen_peep_live (r, r[i].target) == j) {
+						r[j].refs--;
+						r[i].op = OP_DROP;
+						changed = 1;
+					}
+					break;
+				case OP_PSHI:
+					if (!r[j].refs && (r[j].op == OP_JZ || r[j].op == OP_JNZ)) {
+						if (tn_gen_peep_branch (ch, r, i, j) == r[j].target)
+							r[j].op = OP_JMP;
+						else
+							tn_gen_peep_kill (r, j);
+
+						tn_gen_peep_kill (r, i);
+						changed = 1;
+						break;
+					}
+					else if (!r[j].refs && r[j].op == OP_JMP) {
+						uint32_t to = tn_gen_peep_live (r, r[j].target);
+
+						if (r[to].op == OP_JZ || r[to].op == OP_JNZ) {
+							tn_gen_peep_retarget (r, j, tn_gen_peep_branch (ch, r, i, to));
+							tn_gen_peep_kill (r, i);
+							changed = 1;
+							break;
+						}
+					}
+					// fall through
+				case OP_PSHD:
+				case OP_PSHS:
+				case OP_NIL:
+					if (!r[j].refs && r[j].op == OP_DROP) {
+						tn_gen_peep_kill (r, i);
+						tn_gen_peep_kill (r, j);
+						changed = 1;
+					}
+					break;
+				case OP_EQ: case OP_NEQ: case OP_LT:
+				case OP_LTE: case OP_GT: case OP_GTE:
+					if (!r[j].refs && r[j].op == OP_JZ) {
+						r[j].op = OP_EQJZ + (r[i].op - OP_EQ);
+						tn_gen_peep_kill (r, i);
+						changed = 1;
+					}
+					break;
+				case OP_NOT:
+					if (!r[j].refs && (r[j].op == OP_JZ || r[j].op == OP_JNZ)) {
+						r[j].op = r[j].op == OP_JZ ? OP_JNZ : OP_JZ;
+						tn_gen_peep_kill (r, i);
+						changed = 1;
+					}
+					break;
+				case OP_SET:
+					if (fn && !read[tn_gen_read32 (ch->code + r[i].pc + 1)]) {
+						tn_gen_peep_kill (r, i);
+						changed = 1;
+					}
+					break;
+				default: break;
+			}
+		}
+
+		any |= changed;
+	} while (changed);
+
+	if (!any)
+		goto out;
+
+	if (!(at = malloc ((n + 1) * sizeof (*at)))) // new offset of each record
+		goto error;
+
+	// new offsets, a removed instruction gets the one of whatever follows
+	for (i = 0, pc = 0; i < n; i++) {
+		at[i] = pc;
+
+		if (r[i].dead)
+			continue;
+		else if (tn_gen_peep_jump (r[i].op))
+			pc += 5;
+		else if (r[i].op != ch->code[r[i].pc])
+			pc++;
+		else
+			pc += r[i + 1].pc - r[i].pc;
+	}
+
+	at[n] = pc;
+
+	// every instruction is at or before where it was, so this can go over the old code
+	for (i = 0; i < n; i++) {
+		pc = at[i];
+
+		if (r[i].dead)
+			continue;
+		else if (tn_gen_peep_jump (r[i].op)) {
+			ch->code[pc] = r[i].op;
+			tn_gen_emitpos (ch, at[r[i].target], pc + 1);
+		}
+		else if (r[i].op != ch->code[r[i].pc])
+			ch->code[pc] = r[i].op;
+		else if (pc != r[i].pc)
+			memmove (ch->code + pc, ch->code + r[i].pc, r[i + 1].pc - r[i].pc);
+	}
+
+	ch->pc = at[n];
+
+out:
+	free (r);
+	free (at);
+	free (read);
+	return;
+
+error:
+	tn_error ("malloc failed\n");
+	goto out;
+}
+
+// the byte code is allocated from arena, so it only lasts until the chunk is decoded
+struct tn_chunk *tn_gen_compile (struct tn_arena *arena, struct tn_expr *ex, struct tn_expr_data_fn *fn,
                                  struct tn_chunk *next, struct tn_chunk_vars *vars)
 {
 	int i;
@@ -316,27 +1208,34 @@ struct tn_chunk *tn_gen_compile (struct tn_expr *ex, struct tn_expr_data_fn *fn,
 	if (!ret)
 		goto error;
 
+	ret->arena = arena;
 	ret->codelen = 16;
-	ret->code = malloc (ret->codelen);
+	ret->code = tn_arena_alloc (arena, ret->codelen);
 
 	if (!ret->code)
 		goto error;
 
 	ret->pc = 0;
-	ret->name = fn ? fn->name : NULL;
+	ret->insns = NULL;
+	ret->insnlen = 0;
+	ret->name = fn ? fn->name : NULL; // interned
 	array_init (ret->subch);
+	array_init (ret->consts);
 	ret->path = NULL;
-	if (vars)
+	ret->owner = NULL;
+
+	if (vars) {
 		ret->vars = vars;
+		vars->refs++;
+	}
 	else {
 		ret->vars = malloc (sizeof (*ret->vars));
 
-		if (!ret->vars) {
-			free (ret->code);
+		if (!ret->vars)
 			goto error;
-		}
 
 		ret->vars->maxid = 0;
+		ret->vars->refs = 1;
 		ret->vars->hash = tn_hash_new (8);
 	}
 
@@ -361,6 +1260,10 @@ struct tn_chunk *tn_gen_compile (struct tn_expr *ex, struct tn_expr_data_fn *fn,
 	}
 
 	tn_gen_emit8 (ret, OP_RET);
+
+	if (tn_gen_opt >= 2)
+		tn_gen_peephole (ret, fn != NULL);
+
 	return ret;
 
 error:
@@ -368,3 +1271,24 @@ error:
 	free (ret);
 	return NULL;
 }
+
+// frees ch and its sub-chunks. loaded code is freed by the GC, see tn_chunk.owner
+void tn_gen_free (struct tn_chunk *ch)
+{
+	int i;
+
+	for (i = 0; i < ch->subch_num; i++)
+		tn_gen_free (ch->subch[i]);
+
+	tn_decode_free (ch);
+
+	if (--ch->vars->refs == 0) {
+		tn_hash_free (ch->vars->hash);
+		free (ch->vars);
+	}
+
+	free ((char*)ch->path);
+	free (ch->subch);
+	free (ch->consts);
+	free (ch);
+}
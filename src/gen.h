@@ -1,10 +1,15 @@
 #ifndef GEN_H__
 #define GEN_H__
 
+struct tn_arena;
 struct tn_chunk;
 struct tn_chunk_vars;
+struct tn_expr;
 struct tn_expr_data_fn;
-struct tn_chunk *tn_gen_compile (struct tn_expr *ex, struct tn_expr_data_fn *fn,
+void tn_gen_set_opt (int level);
+void tn_gen_fold (struct tn_arena *arena, struct tn_expr *ex, int open);
+struct tn_chunk *tn_gen_compile (struct tn_arena *arena, struct tn_expr *ex, struct tn_expr_data_fn *fn,
                                  struct tn_chunk *next, struct tn_chunk_vars *vars);
+void tn_gen_free (struct tn_chunk *ch);
 
 #endif
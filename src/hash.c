@@ -2,16 +2,22 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "error.h"
+#ifdef TN_HASH_RLUT
 #include "hash_rand.h" // for rlut
+#endif
 #include "hash.h"
+#include "intern.h"
 
-uint32_t tn_hash_string (const char *s)
+#ifdef TN_HASH_RLUT
+// the old byte at a time hash, unseeded
+uint32_t tn_hash_bytes (const char *s, size_t len)
 {
 	uint32_t ret = 0;
 
-	while (*s) {
+	while (len--) {
 		ret ^= rlut[(unsigned char)*(s++)];
 		ret = (ret << 7) | (ret >> 25);
 	}
@@ -19,6 +25,161 @@ uint32_t tn_hash_string (const char *s)
 	return ret;
 }
 
+uint32_t tn_hash_string (const char *s)
+{
+	return tn_hash_bytes (s, strlen (s));
+}
+#else
+/* a wyhash style hash, reading 8 bytes at a time and mixing with 64x64->128
+   bit multiplies. it's seeded once per process, so the layout of a table (and
+   which keys collide) can't be worked out ahead of time. TRITON_HASH_SEED sets
+   the seed, for reproducing something */
+static const uint64_t tn_hash_secret[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static uint64_t tn_hash_seed;
+static int tn_hash_seeded;
+
+static void tn_hash_mum (uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	__extension__ unsigned __int128 r = *a;
+
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl, lo;
+
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t tn_hash_mix (uint64_t a, uint64_t b)
+{
+	tn_hash_mum (&a, &b);
+	return a ^ b;
+}
+
+static uint64_t tn_hash_r8 (const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, 8);
+	return v;
+}
+
+static uint64_t tn_hash_r4 (const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy (&v, p, 4);
+	return v;
+}
+
+static void tn_hash_init_seed ()
+{
+	const char *env = getenv ("TRITON_HASH_SEED");
+	FILE *f;
+	struct timespec ts;
+
+	if (env && *env)
+		tn_hash_seed = strtoull (env, NULL, 0);
+	else if ((f = fopen ("/dev/urandom", "rb"))) {
+		if (fread (&tn_hash_seed, sizeof (tn_hash_seed), 1, f) != 1)
+			tn_hash_seed = 0;
+
+		fclose (f);
+	}
+
+	// no /dev/urandom, so settle for something that at least changes every run
+	if (!tn_hash_seed) {
+		timespec_get (&ts, TIME_UTC);
+		tn_hash_seed = tn_hash_mix (ts.tv_sec ^ tn_hash_secret[2], ts.tv_nsec ^ (uintptr_t)&ts);
+	}
+
+	tn_hash_seed ^= tn_hash_mix (tn_hash_seed ^ tn_hash_secret[0], tn_hash_secret[1]);
+	tn_hash_seeded = 1;
+}
+
+uint32_t tn_hash_bytes (const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)s;
+	size_t i = len;
+	uint64_t a, b, seed, see1, see2;
+
+	if (!tn_hash_seeded)
+		tn_hash_init_seed ();
+
+	seed = tn_hash_seed;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (tn_hash_r4 (p) << 32) | tn_hash_r4 (p + ((len >> 3) << 2));
+			b = (tn_hash_r4 (p + len - 4) << 32) | tn_hash_r4 (p + len - 4 - ((len >> 3) << 2));
+		}
+		else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else {
+		if (i > 48) {
+			see1 = see2 = seed;
+
+			do {
+				seed = tn_hash_mix (tn_hash_r8 (p) ^ tn_hash_secret[1], tn_hash_r8 (p + 8) ^ seed);
+				see1 = tn_hash_mix (tn_hash_r8 (p + 16) ^ tn_hash_secret[2], tn_hash_r8 (p + 24) ^ see1);
+				see2 = tn_hash_mix (tn_hash_r8 (p + 32) ^ tn_hash_secret[3], tn_hash_r8 (p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+
+			seed ^= see1 ^ see2;
+		}
+
+		while (i > 16) {
+			seed = tn_hash_mix (tn_hash_r8 (p) ^ tn_hash_secret[1], tn_hash_r8 (p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		a = tn_hash_r8 (p + i - 16);
+		b = tn_hash_r8 (p + i - 8);
+	}
+
+	a ^= tn_hash_secret[1];
+	b ^= seed;
+	tn_hash_mum (&a, &b);
+	a = tn_hash_mix (a ^ tn_hash_secret[0] ^ len, b ^ tn_hash_secret[1]);
+
+	return (uint32_t)(a ^ (a >> 32));
+}
+
+uint32_t tn_hash_string (const char *s)
+{
+	size_t len;
+
+	// most keys are short identifiers, where calling strlen costs more than this
+	for (len = 0; len < 16 && s[len]; len++);
+
+	if (len == 16)
+		len += strlen (s + 16);
+
+	return tn_hash_bytes (s, len);
+}
+#endif
+
+// how far the entry at i is from where its hash wants it
+#define tn_hash_dist(H, I) (((I) - (H)->entries[I].hash) & ((H)->size - 1))
+
 struct tn_hash *tn_hash_new (int init_size)
 {
 	struct tn_hash *ret = malloc (sizeof (*ret));
@@ -27,90 +188,150 @@ struct tn_hash *tn_hash_new (int init_size)
 		return NULL;
 
 	ret->load = 0;
-	ret->size = init_size;
+	ret->size = 8;
 
-	ret->entries = malloc (init_size * sizeof (*ret->entries));
+	while (ret->size < init_size)
+		ret->size *= 2;
+
+	ret->entries = calloc (ret->size, sizeof (*ret->entries));
 
 	if (!ret->entries) {
 		free (ret);
 		return NULL;
 	}
 
-	memset (ret->entries, 0, init_size * sizeof (*ret->entries));
-
 	return ret;
 }
 
+// the keys and data are left alone
+void tn_hash_free (struct tn_hash *hash)
+{
+	if (!hash)
+		return;
+
+	free (hash->entries);
+	free (hash);
+}
+
+/* robin hood insertion: whichever of the new entry and the one in the way is
+   further from home keeps the slot, and the other one moves on. this keeps
+   probe lengths even, and means a search can stop as soon as it's further from
+   home than the entry it's looking at */
+static void tn_hash_place (struct tn_hash *hash, struct tn_hash_entry ent)
+{
+	uint32_t mask = hash->size - 1, i = ent.hash & mask, dist = 0, d;
+	struct tn_hash_entry tmp;
+
+	while (hash->entries[i].key) {
+		if ((d = tn_hash_dist (hash, i)) < dist) {
+			tmp = hash->entries[i];
+			hash->entries[i] = ent;
+			ent = tmp;
+			dist = d;
+		}
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+
+	hash->entries[i] = ent;
+	hash->load++;
+}
+
 int tn_hash_resize (struct tn_hash *hash)
 {
 	struct tn_hash_entry *old = hash->entries;
 	int oldsize = hash->size;
 	int i;
 
-	hash->load = 0;
-	hash->size *= 2;
-	hash->entries = malloc (hash->size * sizeof (*hash->entries));
+	hash->entries = calloc (oldsize * 2, sizeof (*hash->entries));
 
 	if (!hash->entries) {
 		tn_error ("malloc failed\n");
-		free (old);
+		hash->entries = old;
 		return 1;
 	}
 
-	memset (hash->entries, 0, hash->size * sizeof (*hash->entries));
+	hash->load = 0;
+	hash->size = oldsize * 2;
 
-	for (i = 0; i < oldsize; i++) {
-		if (old[i].key && tn_hash_insert (hash, old[i].key, old[i].data)) {
-			tn_error ("rehashing failed after resizing\n");
-			free (old);
-			return 1;
-		}
-	}
+	for (i = 0; i < oldsize; i++)
+		if (old[i].key)
+			tn_hash_place (hash, old[i]);
 
+	free (old);
 	return 0;
 }
 
+static int tn_hash_find (struct tn_hash *hash, const char *key)
+{
+	uint32_t h = tn_intern_hash (key), mask = hash->size - 1, i = h & mask, dist = 0;
+	struct tn_hash_entry *ent;
+
+	while (1) {
+		ent = &hash->entries[i];
+
+		if (!ent->key || tn_hash_dist (hash, i) < dist)
+			return -1;
+
+		if (ent->key == key)
+			return i;
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+}
+
+// inserting a key that's already there replaces its data
 int tn_hash_insert (struct tn_hash *hash, const char *key, void *data)
 {
-	uint32_t keyval;
+	int i = tn_hash_find (hash, key);
+
+	if (i >= 0) {
+		hash->entries[i].data = data;
+		return 0;
+	}
 
-	if (hash->load > hash->size * 0.75 && tn_hash_resize (hash)) {
+	if ((hash->load + 1) * 8 > hash->size * 7 && tn_hash_resize (hash)) {
 		tn_error ("failed to resize hash table\n");
 		return 1;
 	}
 
-	keyval = tn_hash_string (key) % hash->size;
+	tn_hash_place (hash, (struct tn_hash_entry) { key, data, tn_intern_hash (key) });
+	return 0;
+}
 
-	while (hash->entries[keyval].key) {
-		keyval++;
-		keyval %= hash->size;
-	}
+/* entries after the deleted one are shifted back into its place, for as long
+   as they aren't already home, so there's no need for tombstones. returns 1 if
+   the key wasn't there. like tn_hash_free, the key itself is left alone */
+int tn_hash_delete (struct tn_hash *hash, const char *key)
+{
+	uint32_t mask = hash->size - 1, next;
+	int i = tn_hash_find (hash, key);
 
-//	printf ("%s - %u/%u\n", key, keyval, hash->size);
+	if (i < 0)
+		return 1;
 
-	hash->entries[keyval].key = key;
-	hash->entries[keyval].data = data;
+	next = (i + 1) & mask;
 
-	hash->load++;
+	while (hash->entries[next].key && tn_hash_dist (hash, next) > 0) {
+		hash->entries[i] = hash->entries[next];
+		i = next;
+		next = (next + 1) & mask;
+	}
+
+	hash->entries[i].key = NULL;
+	hash->entries[i].data = NULL;
+	hash->load--;
 
 	return 0;
 }
 
 void *tn_hash_search_ref (struct tn_hash *hash, const char *key)
 {
-	uint32_t keyval = tn_hash_string (key) % hash->size;
-
-	while (hash->entries[keyval].key) {
-	//	printf ("checking %s - %u/%u\n", hash->entries[keyval].key, keyval, hash->size);
-		if (!strcmp (key, hash->entries[keyval].key))
-			return &hash->entries[keyval].data;
-		else {
-			keyval++;
-			keyval %= hash->size;
-		}
-	}
+	int i = tn_hash_find (hash, key);
 
-	return NULL;
+	return i >= 0 ? &hash->entries[i].data : NULL;
 }
 
 void *tn_hash_search (struct tn_hash *hash, const char *key)
@@ -119,25 +340,110 @@ void *tn_hash_search (struct tn_hash *hash, const char *key)
 	return ref ? *ref : NULL;
 }
 
-#if 0
-static char *keygen ()
+/* microbenchmark, build with
+	cc -O2 -DTN_HASH_BENCH -o hashbench src/hash.c src/intern.c src/error.c
+   and run as ./hashbench [keys] */
+#ifdef TN_HASH_BENCH
+
+// identifier-ish keys, "a", "b", ... "z", "ba", "bb", ...
+static const char *keygen (int n)
+{
+	static char key[16];
+	char *p = key + sizeof (key) - 1;
+
+	*p = 0;
+
+	do {
+		*--p = 'a' + n % 26;
+		n /= 26;
+	} while (n);
+
+	return p;
+}
+
+static double tn_hash_bench_now ()
+{
+	struct timespec ts;
+
+	timespec_get (&ts, TIME_UTC);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main (int argc, char **argv)
 {
-	static char key[] = "aaaa";
-	char *ret;
-	int pos = strlen (key) - 1;
+	int i, n = argc > 1 ? atoi (argv[1]) : 100000, rounds = 10, r, bad = 0, len;
+	uint32_t h = 0;
+	const char **keys = malloc (n * sizeof (*keys)), **misses = malloc (n * sizeof (*misses));
+	char miss[18];
+	struct tn_hash *hash;
+	double t;
+
+	// misses are the same keys with a prefix
+	for (i = 0; i < n; i++) {
+		keys[i] = tn_intern (keygen (i));
+		sprintf (miss, "_%s", keys[i]);
+		misses[i] = tn_intern (miss);
+	}
+
+	t = tn_hash_bench_now ();
+	for (r = 0; r < rounds; r++) {
+		hash = tn_hash_new (8);
+
+		for (i = 0; i < n; i++)
+			tn_hash_insert (hash, keys[i], (void*)keys[i]);
+
+		if (r < rounds - 1)
+			tn_hash_free (hash);
+	}
+	printf ("insert: %.1f ns\n", (tn_hash_bench_now () - t) / rounds / n);
+
+	t = tn_hash_bench_now ();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++)
+			bad += tn_hash_search (hash, keys[i]) != keys[i];
+	printf ("hit: %.1f ns\n", (tn_hash_bench_now () - t) / rounds / n);
+
+	t = tn_hash_bench_now ();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++)
+			bad += tn_hash_search (hash, misses[i]) != NULL;
+	printf ("miss: %.1f ns\n", (tn_hash_bench_now () - t) / rounds / n);
+
+	t = tn_hash_bench_now ();
+	for (i = 0; i < n; i += 2)
+		bad += tn_hash_delete (hash, keys[i]);
+	printf ("delete: %.1f ns\n", (tn_hash_bench_now () - t) / (n / 2));
+
+	for (i = 0; i < n; i++)
+		bad += tn_hash_search (hash, keys[i]) != (i % 2 ? keys[i] : NULL);
+
+	printf ("%d keys, %d slots, %d wrong results\n", n, hash->size, bad);
+
+	// hashing alone, for short identifiers and longer strings
+	t = tn_hash_bench_now ();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++)
+			h += tn_hash_string (keys[i]);
+	printf ("hash keys: %.1f ns\n", (tn_hash_bench_now () - t) / rounds / n);
+
+	for (len = 16; len <= 65536; len *= 16) {
+		char *str = malloc (len + 1);
+
+		for (i = 0; i < len; i++)
+			str[i] = 'a' + i % 26;
+
+		str[len] = 0;
 
-	while (pos >= 0) {
-		if (key[pos] > 'z') {
-			key[pos] = 'a';
-			key[--pos]++;
-			continue;
+		t = tn_hash_bench_now ();
+		for (i = 0; i < (1 << 24) / len; i++) {
+			h += tn_hash_string (str + (i & 7));
 		}
+		printf ("hash %d bytes: %.0f MB/s\n", len, (double)i * len / 1e6 / ((tn_hash_bench_now () - t) / 1e9));
 
-		ret = strdup (key);
-		key[pos]++;
-		return ret;
+		free (str);
 	}
 
-	return NULL;
+	printf ("(%u)\n", h);
+	return bad != 0;
 }
 #endif
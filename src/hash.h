@@ -1,20 +1,29 @@
 #ifndef HASH_H_
 #define HASH_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* open addressing with robin hood probing. size is always a power of two, and
+   each entry keeps its key's full hash, so resizing doesn't rehash anything.
+   keys must be interned (see intern.h): their hash comes from the intern table
+   and they're compared by pointer. empty entries have a NULL key */
 struct tn_hash {
 	int load, size;
 	struct tn_hash_entry {
 		const char *key;
 		void *data;
+		uint32_t hash;
 	} *entries;
 };
 
+uint32_t tn_hash_bytes (const char *s, size_t len);
 uint32_t tn_hash_string (const char *s);
 struct tn_hash *tn_hash_new (int init_size);
+void tn_hash_free (struct tn_hash *hash);
 int tn_hash_resize (struct tn_hash *hash);
 int tn_hash_insert (struct tn_hash *hash, const char *key, void *data);
+int tn_hash_delete (struct tn_hash *hash, const char *key);
 void *tn_hash_search_ref (struct tn_hash *hash, const char *key);
 void *tn_hash_search (struct tn_hash *hash, const char *key);
 
@@ -49,7 +49,7 @@ int tn_import_set_path (char *path)
 	return 0;
 }
 
-struct tn_chunk *tn_import_load (const char *name, const char *from)
+struct tn_chunk *tn_import_load (struct tn_vm *vm, const char *name, const char *from)
 {
 	int i;
 	char path[PATH_MAX];
@@ -62,7 +62,7 @@ struct tn_chunk *tn_import_load (const char *name, const char *from)
 		snprintf (path, PATH_MAX, "%s/%s.tn", tn_import_path[i], name);
 //		printf ("trying %s\n", path);
 
-		ret = tn_load_file (path, NULL);
+		ret = tn_load_file (vm, path, NULL);
 
 		if (ret)
 			return ret;
@@ -1,7 +1,8 @@
 #ifndef IMPORT_H__
 #define IMPORT_H__
 
+struct tn_vm;
 int tn_import_set_path (char *path);
-struct tn_chunk *tn_import_load (const char *name, const char *from);
+struct tn_chunk *tn_import_load (struct tn_vm *vm, const char *name, const char *from);
 
 #endif
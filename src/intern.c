@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "hash.h"
+#include "intern.h"
+
+/* the table is shared by the whole process: the lexer and the decoder intern
+   names before there's any vm around to hang it off, and there's only ever one
+   vm anyway. it's plain linear probing, since nothing is ever removed */
+static struct tn_intern_str **tn_intern_table;
+static uint32_t tn_intern_size, tn_intern_load;
+
+static int tn_intern_grow ()
+{
+	struct tn_intern_str **old = tn_intern_table;
+	uint32_t oldsize = tn_intern_size, size = oldsize ? oldsize * 2 : 256, mask = size - 1, i, j;
+
+	tn_intern_table = calloc (size, sizeof (*tn_intern_table));
+
+	if (!tn_intern_table) {
+		tn_error ("malloc failed\n");
+		tn_intern_table = old;
+		return 1;
+	}
+
+	tn_intern_size = size;
+
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i])
+			continue;
+
+		for (j = old[i]->hash & mask; tn_intern_table[j]; j = (j + 1) & mask);
+		tn_intern_table[j] = old[i];
+	}
+
+	free (old);
+	return 0;
+}
+
+// s doesn't need to be terminated, the interned copy always is
+const char *tn_intern_len (const char *s, size_t len)
+{
+	uint32_t h = tn_hash_bytes (s, len), mask, i;
+	struct tn_intern_str *str;
+
+	if ((tn_intern_load + 1) * 4 > tn_intern_size * 3 && tn_intern_grow ())
+		return NULL;
+
+	mask = tn_intern_size - 1;
+
+	for (i = h & mask; (str = tn_intern_table[i]); i = (i + 1) & mask)
+		if (str->hash == h && str->len == len && !memcmp (str->s, s, len))
+			return str->s;
+
+	str = malloc (sizeof (*str) + len + 1);
+
+	if (!str) {
+		tn_error ("malloc failed\n");
+		return NULL;
+	}
+
+	str->bind = NULL;
+	str->hash = h;
+	str->len = len;
+	memcpy (str->s, s, len);
+	str->s[len] = 0;
+
+	tn_intern_table[i] = str;
+	tn_intern_load++;
+
+	return str->s;
+}
+
+const char *tn_intern (const char *s)
+{
+	return tn_intern_len (s, strlen (s));
+}
@@ -0,0 +1,25 @@
+#ifndef INTERN_H__
+#define INTERN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* every distinct string passed through tn_intern is stored exactly once, and
+   lives until the process exits. two interned strings are equal exactly when
+   they're the same pointer, and each one carries its hash and length just in
+   front of it, so tables keyed by them never look at the characters at all */
+struct tn_intern_str {
+	void *bind; // for a pass over a syntax tree to hang a name's binding on, NULL otherwise
+	uint32_t hash, len;
+	char s[];
+};
+
+const char *tn_intern (const char *s);
+const char *tn_intern_len (const char *s, size_t len);
+
+#define tn_intern_str(S) ((const struct tn_intern_str*)((S) - offsetof (struct tn_intern_str, s)))
+#define tn_intern_hash(S) (tn_intern_str (S)->hash)
+#define tn_intern_length(S) (tn_intern_str (S)->len)
+#define tn_intern_bind(S) (((struct tn_intern_str*)((char*)(S) - offsetof (struct tn_intern_str, s)))->bind)
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "error.h"
+#include "intern.h"
 #include "hash.h"
 #include "value.h"
 #include "gc.h"
@@ -78,13 +79,13 @@ struct tn_hash *tn_io_module (struct tn_vm *vm)
 {
 	struct tn_hash *ret = tn_hash_new (8);
 
-	tn_hash_insert (ret, "stdin", tn_gc_preserve (tn_cval (vm, stdin, NULL)));
-	tn_hash_insert (ret, "stdout", tn_gc_preserve (tn_cval (vm, stdout, NULL)));
-	tn_hash_insert (ret, "stderr", tn_gc_preserve (tn_cval (vm, stderr, NULL)));
-	tn_hash_insert (ret, "fprintf", tn_gc_preserve (tn_cfun (vm, tn_io_fprintf)));
-	tn_hash_insert (ret, "printf", tn_gc_preserve (tn_cfun (vm, tn_io_printf)));
-	tn_hash_insert (ret, "fopen", tn_gc_preserve (tn_cfun (vm, tn_io_fopen)));
-	tn_hash_insert (ret, "fclose", tn_gc_preserve (tn_cfun (vm, tn_io_fclose)));
+	tn_hash_insert (ret, tn_intern ("stdin"), tn_cval_const (stdin, NULL));
+	tn_hash_insert (ret, tn_intern ("stdout"), tn_cval_const (stdout, NULL));
+	tn_hash_insert (ret, tn_intern ("stderr"), tn_cval_const (stderr, NULL));
+	tn_hash_insert (ret, tn_intern ("fprintf"), tn_cfun_const (tn_io_fprintf));
+	tn_hash_insert (ret, tn_intern ("printf"), tn_cfun_const (tn_io_printf));
+	tn_hash_insert (ret, tn_intern ("fopen"), tn_cfun_const (tn_io_fopen));
+	tn_hash_insert (ret, tn_intern ("fclose"), tn_cfun_const (tn_io_fclose));
 
 	return ret;
 }
@@ -1,66 +1,144 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "error.h"
+#include "intern.h"
 #include "parser.h"
 #include "lexer.h"
 #include "gen.h"
 #include "vm.h"
 
-// these need to be in order of descending length, so that we find the longest match first
-static struct tn_builtin {
+/* keywords are lexed as identifiers, then looked up here. (first char ^ length)
+   & 7 happens to be different for each of them, so there's only ever one
+   entry to compare against */
+static const struct tn_lexer_keyword {
 	const char *str;
+	size_t len;
 	enum tn_token_type type;
-} builtins[] = {
-	{ "import", TOK_IMPT },
-	{ "else", TOK_ELSE },
-	{ "nil", TOK_NIL },
-	{ "...", TOK_ELPS },
-	{ "do", TOK_DO },
-	{ "fn", TOK_FN },
-	{ "if", TOK_IF },
-	{ "==", TOK_EQ },
-	{ "!=", TOK_NEQ },
-	{ "<=", TOK_LTE },
-	{ ">=", TOK_GTE },
-	{ "&&", TOK_ANDL },
-	{ "||", TOK_ORL },
-	{ "..", TOK_CAT },
-	{ "::", TOK_LCAT },
-	{ "=", TOK_ASSN },
-	{ "<", TOK_LT },
-	{ ">", TOK_GT },
-	{ "(", TOK_LPAR },
-	{ ")", TOK_RPAR },
-	{ "[", TOK_LBRK },
-	{ "]", TOK_RBRK },
-	{ ",", TOK_COMM },
-	{ "+", TOK_ADD },
-	{ "-", TOK_SUB },
-	{ "*", TOK_MUL },
-	{ "/", TOK_DIV },
-	{ "%", TOK_MOD },
-	{ ":", TOK_COL },
-	{ ";", TOK_SCOL },
-	{ "!", TOK_EXCL },
-	{ NULL, TOK_ZERO }
+} tn_lexer_keywords[8] = {
+	[1] = { "else", 4, TOK_ELSE },
+	[3] = { "if", 2, TOK_IF },
+	[4] = { "fn", 2, TOK_FN },
+	[5] = { "nil", 3, TOK_NIL },
+	[6] = { "do", 2, TOK_DO },
+	[7] = { "import", 6, TOK_IMPT }
 };
 
-static int tn_lexer_identifier (const char **src, struct tn_token *ret)
+#define tn_lexer_keyword_hash(S, LEN) (((unsigned char)*(S) ^ (LEN)) & 7)
+
+// character classes, so that runs of each can be skipped with one table lookup per character
+enum {
+	TN_LEXER_SPACE = 1,
+	TN_LEXER_DIGIT = 2,
+	TN_LEXER_ALPHA = 4, // letters and _, which can start an identifier
+	TN_LEXER_IDENT = 8, // and everything that can continue one
+	TN_LEXER_PLAIN = 16 // anything in a string literal that isn't ", \ or the end
+};
+
+static unsigned char tn_lexer_class[256];
+
+static void tn_lexer_init_class ()
+{
+	int i;
+
+	for (i = 1; i < 256; i++) {
+		tn_lexer_class[i] = (isspace (i) ? TN_LEXER_SPACE : 0)
+		                  | (isdigit (i) ? TN_LEXER_DIGIT | TN_LEXER_IDENT : 0)
+		                  | (isalpha (i) || i == '_' ? TN_LEXER_ALPHA | TN_LEXER_IDENT : 0)
+		                  | (i != '"' && i != '\\' ? TN_LEXER_PLAIN : 0);
+	}
+}
+
+/* with sse2, runs are scanned 16 bytes at a time. the loads are aligned, so
+   they never cross into a page the source doesn't reach, and the nul at the
+   end stops every class. that does mean reading a few bytes past the end of
+   the buffer, which asan would otherwise complain about */
+#if defined (__SSE2__) && defined (__GNUC__)
+#include <emmintrin.h>
+
+#ifdef __SANITIZE_ADDRESS__
+#define TN_LEXER_UNCHECKED __attribute__ ((no_sanitize_address))
+#else
+#define TN_LEXER_UNCHECKED
+#endif
+
+#define tn_lexer_range(V, LO, HI) \
+	_mm_and_si128 (_mm_cmpgt_epi8 (V, _mm_set1_epi8 ((LO) - 1)), _mm_cmplt_epi8 (V, _mm_set1_epi8 ((HI) + 1)))
+
+// a bit for each of the 16 characters at c that's in cls
+static inline int tn_lexer_block (const char *c, int cls)
+{
+	__m128i v = _mm_load_si128 ((const __m128i*)c), in, lower;
+
+	switch (cls) {
+		case TN_LEXER_SPACE:
+			in = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')), tn_lexer_range (v, '\t', '\r'));
+			break;
+		case TN_LEXER_IDENT:
+			lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+			in = _mm_or_si128 (_mm_or_si128 (tn_lexer_range (lower, 'a', 'z'), tn_lexer_range (v, '0', '9')),
+			                   _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_')));
+			break;
+		default: // TN_LEXER_PLAIN
+			in = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')), _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\'))),
+			                   _mm_cmpeq_epi8 (v, _mm_setzero_si128 ()));
+			return _mm_movemask_epi8 (in) ^ 0xffff;
+	}
+
+	return _mm_movemask_epi8 (in);
+}
+
+// returns the first character after c that isn't in cls
+TN_LEXER_UNCHECKED static inline char *tn_lexer_run (char *c, int cls)
+{
+	int out;
+	char *end = c + 16;
+
+	/* most runs are short, so the first 16 characters are checked one at a
+	   time, and then up to a 16 byte boundary */
+	for (; c < end || (uintptr_t)c & 15; c++)
+		if (!(tn_lexer_class[(unsigned char)*c] & cls))
+			return c;
+
+	while ((out = tn_lexer_block (c, cls) ^ 0xffff) == 0)
+		c += 16;
+
+	return c + __builtin_ctz (out);
+}
+#else
+static char *tn_lexer_run (char *c, int cls)
 {
-	int len;
-	const char *c = *src;
+	while (tn_lexer_class[(unsigned char)*c] & cls)
+		c++;
 
-	// count how many characters we need to copy over
-	while (*c && (isalpha (*c) || isdigit (*c) || *c == '_') && ++c);
+	return c;
+}
+#endif
+
+static int tn_lexer_identifier (char **src, struct tn_token *ret)
+{
+	char *c = tn_lexer_run (*src, TN_LEXER_IDENT);
+	size_t len = c - *src;
+	const struct tn_lexer_keyword *kw = &tn_lexer_keywords[tn_lexer_keyword_hash (*src, len)];
+
+	if (kw->len == len && !memcmp (*src, kw->str, len)) {
+		ret->type = kw->type;
+		ret->data.s = kw->str;
+		*src = c;
+		return 0;
+	}
 
-	len = c - *src;
 	ret->type = TOK_IDENT;
 
-	// eventually, we should look up identifiers in a hash table, so that we don't have a bunch of duplicate data
-	ret->data.s = strndup (*src, len);
+	// every use of a name shares one copy, which can be compared by pointer
+	ret->data.s = tn_intern_len (*src, len);
 	if (!ret->data.s)
 		return 1;
 
@@ -68,14 +146,14 @@ static int tn_lexer_identifier (const char **src, struct tn_token *ret)
 	return 0;
 }
 
-static int tn_lexer_number (const char **src, struct tn_token *ret)
+static int tn_lexer_number (char **src, struct tn_token *ret)
 {
 	int i = 0, frac = 0;
 	double d = 0.0, div = 1;
-	const char *c = *src;
+	char *c = *src;
 
 	// first, we read into the int
-	while (isdigit (*c)) {
+	while (tn_lexer_class[(unsigned char)*c] & TN_LEXER_DIGIT) {
 		i = i * 10 + (*c - '0');
 		c++;
 	}
@@ -85,7 +163,7 @@ static int tn_lexer_number (const char **src, struct tn_token *ret)
 		c++;
 
 		// start reading in the fractional portion
-		while (isdigit (*c)) {
+		while (tn_lexer_class[(unsigned char)*c] & TN_LEXER_DIGIT) {
 			frac = frac * 10 + (*c - '0');
 			c++;
 			div *= 10.0;
@@ -95,7 +173,7 @@ static int tn_lexer_number (const char **src, struct tn_token *ret)
 		ret->type = TOK_FLOAT;
 		ret->data.d = d;
 	}
-	else if (isalpha (*c) || *c == '_') { // this is an identifier, not a number
+	else if (tn_lexer_class[(unsigned char)*c] & TN_LEXER_ALPHA) { // this is an identifier, not a number
 		return tn_lexer_identifier (src, ret);
 	}
 	else {
@@ -107,57 +185,46 @@ static int tn_lexer_number (const char **src, struct tn_token *ret)
 	return 0;
 }
 
-static int tn_lexer_string (const char **src, struct tn_token *ret)
+/* string literals are unescaped in place, and the token points into the
+   source rather than at a copy. the result is never longer than the literal,
+   so it always fits, and its terminator goes at or before the closing quote */
+static int tn_lexer_string (char **src, struct tn_token *ret)
 {
-	char *str;
-	const char *c = (*src) + 1;
-	int len = 0;
-
-	// count string length
-	while (*c && *c != '"') {
-		len++;
-		c += (*c == '\\') ? 2 : 1;
-	}
+	char *c = *src + 1, *out = c, *end;
 
-	if (*c == '\0')
-		return 1;
+	ret->type = TOK_STRING;
+	ret->data.s = out;
 
-	str = malloc (len + 1);
-	if (!str)
-		return 1;
+	while (1) {
+		// copy over everything up to the next escape or the end
+		end = tn_lexer_run (c, TN_LEXER_PLAIN);
 
-	*src = c + 1;
-	c--; // go back to the very ending of the string
-	str[len--] = '\0';
-
-	// go over the string again, copying it over and converting escaped chars
-	// this is admittedly pretty ugly
-	while (*c != '"') {
-		switch (*(c - 1)) {
-			case '\\':
-				switch (*c) {
-					case 'n':
-						str[len--] = '\n';
-						break;
-					default: break;
-				}
-				c -= 2;
-				break;
-			default:
-				str[len--] = *(c--);
-				break;
+		if (out != c)
+			memmove (out, c, end - c);
+
+		out += end - c;
+		c = end;
+
+		if (*c == '"')
+			break;
+		else if (*c == '\\' && c[1]) {
+			c++;
+			*(out++) = *c == 'n' ? '\n' : *c;
+			c++;
 		}
+		else
+			return 1;
 	}
 
-	ret->type = TOK_STRING;
-	ret->data.s = str;
+	*src = c + 1;
+	*out = '\0';
 	return 0;
 }
 
-int tn_lexer_comment (const char **src)
+int tn_lexer_comment (char **src)
 {
 	int block;
-	const char *c = *src + 1;
+	char *c = *src + 1;
 
 	// block comment?
 	block = *(c++) == '-';
@@ -178,119 +245,244 @@ int tn_lexer_comment (const char **src)
 	return !block; // only non-block comments can be terminated by a null character
 }
 
-static struct tn_token *tn_lexer_token (const char **src)
+// two character operators, given the first one. the second is 0 if there's only the one
+#define TN_LEXER_OP2(C1, T1, C2, T2) \
+	case C1: \
+		if (c[1] == C2) { \
+			ret->type = T2; \
+			*src = c + 2; \
+		} \
+		else if (T1) { \
+			ret->type = T1; \
+			*src = c + 1; \
+		} \
+		else \
+			break; \
+		return 0;
+
+#define TN_LEXER_OP(C, T) \
+	case C: \
+		ret->type = T; \
+		*src = c + 1; \
+		return 0;
+
+// fills in ret with the next token, which is TOK_ZERO at the end of the source
+static int tn_lexer_token (char **src, struct tn_token *ret)
 {
-	const char *c;
-	int i, len;
-	struct tn_token *ret;
+	char *c;
 
 	// skip to the first non-space character
-	while (**src && isspace (**src) && ++(*src));
-	c = *src;
+	c = *src = tn_lexer_run (*src, TN_LEXER_SPACE);
 
 	// end of string
-	if (*c == '\0')
-		return NULL;
-
-	ret = malloc (sizeof (*ret));
-	if (!ret)
-		return NULL;
-
-	// see if the token is a number
-	if (isdigit (*c) && !tn_lexer_number (src, ret))
-		return ret;
-
-	// see if the token is a string literal
-	if (*c == '"' && !tn_lexer_string (src, ret))
-		return ret;
-
-	// see if the token is a builtin
-	for (i = 0; builtins[i].str; i++) {
-		len = strlen (builtins[i].str);
-
-		if (!strncmp (c, builtins[i].str, len)) {
-			ret->type = builtins[i].type;
-			ret->data.s = builtins[i].str;
-			*src = c + len;
-			return ret;
-		}
+	if (*c == '\0') {
+		ret->type = TOK_ZERO;
+		return 0;
 	}
 
-	// see if the token is an identifier
-	if ((isalpha (*c) || *c == '_') && !tn_lexer_identifier (src, ret))
-		return ret;
-
-	free (ret);
-
-	// last option is that this is a comment
+	// comments don't make a token, call this again to get the next one
 	if (*c == '#' && tn_lexer_comment (src))
-		return tn_lexer_token (src); // call this again to get the next token
+		return tn_lexer_token (src, ret);
+
+	// the first character is enough to tell what kind of token this is
+	switch (*c) {
+		case '"':
+			if (!tn_lexer_string (src, ret))
+				return 0;
+			break;
+		case '.':
+			if (c[1] == '.') {
+				ret->type = c[2] == '.' ? TOK_ELPS : TOK_CAT;
+				*src = c + (c[2] == '.' ? 3 : 2);
+				return 0;
+			}
+			break;
+		TN_LEXER_OP2 ('=', TOK_ASSN, '=', TOK_EQ)
+		TN_LEXER_OP2 ('!', TOK_EXCL, '=', TOK_NEQ)
+		TN_LEXER_OP2 ('<', TOK_LT, '=', TOK_LTE)
+		TN_LEXER_OP2 ('>', TOK_GT, '=', TOK_GTE)
+		TN_LEXER_OP2 (':', TOK_COL, ':', TOK_LCAT)
+		TN_LEXER_OP2 ('&', TOK_ZERO, '&', TOK_ANDL)
+		TN_LEXER_OP2 ('|', TOK_ZERO, '|', TOK_ORL)
+		TN_LEXER_OP ('(', TOK_LPAR)
+		TN_LEXER_OP (')', TOK_RPAR)
+		TN_LEXER_OP ('[', TOK_LBRK)
+		TN_LEXER_OP (']', TOK_RBRK)
+		TN_LEXER_OP (',', TOK_COMM)
+		TN_LEXER_OP ('+', TOK_ADD)
+		TN_LEXER_OP ('-', TOK_SUB)
+		TN_LEXER_OP ('*', TOK_MUL)
+		TN_LEXER_OP ('/', TOK_DIV)
+		TN_LEXER_OP ('%', TOK_MOD)
+		TN_LEXER_OP (';', TOK_SCOL)
+		default:
+			if (tn_lexer_class[(unsigned char)*c] & TN_LEXER_DIGIT) {
+				if (!tn_lexer_number (src, ret))
+					return 0;
+			}
+			else if (tn_lexer_class[(unsigned char)*c] & TN_LEXER_ALPHA) {
+				if (!tn_lexer_identifier (src, ret))
+					return 0;
+			}
+			break;
+	}
 
 	tn_error ("unrecognized token at: %s\n", c);
-	return NULL;
+	return 1;
 }
 
-struct tn_token *tn_lexer_tokenize (const char *src, struct tn_token **last)
+void tn_lexer_init (struct tn_lexer *lx, char *src)
 {
-	struct tn_token *ret, *it;
+	if (!tn_lexer_class['a'])
+		tn_lexer_init_class ();
 
-	// grab the first token
-	ret = it = tn_lexer_token (&src);
+	lx->src = src;
+	lx->pos = lx->len = 0;
+	lx->error = 0;
+	lx->tok = lx->ring;
 
-	// keep grabbing tokens until we run out
-	while (it) {
-		if (last)
-			*last = it;
+	tn_lexer_fill (lx, 0);
+}
 
-		it->next = tn_lexer_token (&src);
-		it = it->next;
-	}
+/* refills the ring once it's run out of tokens ahead of the nth. it's topped
+   up a batch at a time, since going back and forth between the lexer and the
+   parser on every token costs more than the lexing, leaving the last couple it
+   handed out alone. after an error, everything from then on is TOK_ZERO, so
+   that the parser winds down as if it had reached the end */
+void tn_lexer_fill (struct tn_lexer *lx, int n)
+{
+	struct tn_token *tok;
+
+	while (lx->len <= n || lx->len < TN_LEXER_RING - 2) {
+		tok = &lx->ring[(lx->pos + lx->len++) & (TN_LEXER_RING - 1)];
 
-	return ret;
+		if (lx->error || tn_lexer_token (&lx->src, tok)) {
+			lx->error = 1;
+			tok->type = TOK_ZERO;
+		}
+
+		if (tok->type == TOK_ZERO && lx->len > n)
+			break;
+	}
 }
 
-struct tn_token *tn_lexer_tokenize_file (FILE *f)
+/* regular files are mapped, copy on write so that strings can be unescaped in
+   place, and lexed straight out of the page cache. the lexer wants a nul at the
+   end, which the zero fill past the end of the file provides, unless the file
+   ends right on a page boundary. that case, and anything that can't be mapped
+   (a pipe, a terminal) is read into a buffer instead. src is set either way,
+   and has to be freed with tn_lexer_free_src */
+int tn_lexer_read_file (FILE *f, struct tn_lexer_src *src)
 {
-	int len = 1;
-	char *src, *bak;
-	char line[4096];
+	int fd = fileno (f);
+	size_t len = 0, size = 4096;
+	ssize_t n;
+	struct stat st;
+	char *buf, *bak;
+
+	src->buf = NULL;
+	src->mapped = 0;
+
+	if (!fstat (fd, &st) && S_ISREG (st.st_mode)) {
+		if (st.st_size % sysconf (_SC_PAGESIZE) && lseek (fd, 0, SEEK_CUR) == 0) {
+			buf = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+			if (buf != MAP_FAILED) {
+				src->buf = buf;
+				src->mapped = st.st_size;
+				return 0;
+			}
+		}
 
-	src = malloc (4096);
+		size = st.st_size + 1;
+	}
 
-	if (!src) {
-		tn_error ("malloc failed");
-		return NULL;
+	if (!(buf = malloc (size))) {
+		tn_error ("malloc failed\n");
+		return 1;
 	}
 
-	src[0] = '\0';
+	while ((n = read (fd, buf + len, size - len - 1))) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			tn_error ("read failed: %s\n", strerror (errno));
+			free (buf);
+			return 1;
+		}
 
-	// read the file line by line, 
-	while (fgets (line, 4096, f)) {
-		len += strlen (line);
+		len += n;
 
-		bak = src;
-		src = realloc (src, len);
+		if (len + 1 == size) {
+			bak = buf;
 
-		if (!src) {
-			tn_error ("realloc failed\n");
-			free (bak);
-			return NULL;
+			if (!(buf = realloc (buf, size *= 2))) {
+				tn_error ("realloc failed\n");
+				free (bak);
+				return 1;
+			}
 		}
-
-		strcat (src, line);
 	}
 
-	return tn_lexer_tokenize (src, NULL);
+	buf[len] = '\0';
+	src->buf = buf;
+	return 0;
+}
+
+void tn_lexer_free_src (struct tn_lexer_src *src)
+{
+	if (src->mapped)
+		munmap (src->buf, src->mapped);
+	else
+		free (src->buf);
+
+	src->buf = NULL;
+	src->mapped = 0;
+}
+
+/* throughput benchmark, build with
+	cc -O2 -DTN_LEXER_BENCH -o lexbench src/lexer.c src/intern.c src/hash.c src/error.c
+   and run as ./lexbench file */
+#ifdef TN_LEXER_BENCH
+#include <time.h>
+
+static double tn_lexer_bench_now ()
+{
+	struct timespec ts;
+
+	timespec_get (&ts, TIME_UTC);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
 }
 
-void tn_lexer_free_tokens (struct tn_token *tok)
+int main (int argc, char **argv)
 {
-	struct tn_token *it, *next = tok;
-	while ((it = next)) {
-		next = it->next;
+	int r, rounds = 20, n = 0;
+	size_t len;
+	double t = 0, start;
+	char *buf;
+	FILE *f = argc > 1 ? fopen (argv[1], "r") : stdin;
+	struct tn_lexer_src src;
+	struct tn_lexer lx;
+
+	if (!f || tn_lexer_read_file (f, &src))
+		return 1;
 
-		if (it->type == TOK_STRING)
-			free ((void*)it->data.s);
-		free (it);
+	// strings are unescaped in place, so every round lexes a fresh copy
+	len = strlen (src.buf);
+	buf = malloc (len + 1);
+
+	for (r = 0; r < rounds; r++) {
+		memcpy (buf, src.buf, len + 1);
+		tn_lexer_init (&lx, buf);
+
+		start = tn_lexer_bench_now ();
+		for (n = 0; tn_lexer_peek (&lx, 0)->type != TOK_ZERO; n++)
+			tn_lexer_next (&lx);
+		t += tn_lexer_bench_now () - start;
 	}
+
+	printf ("%zu bytes, %d tokens: %.0f MB/s, %.1f ns/token\n", len, n, len * rounds / (t / 1e9) / 1e6, t / rounds / n);
+	return 0;
 }
+#endif
@@ -21,12 +21,54 @@ struct tn_token {
 		int i;
 		double d;
 	} data;
+};
 
-	struct tn_token *next;
+/* where a file's source ended up. string literals point into it, so it has to
+   stay around until they've been compiled. mapped is the length of the
+   mapping, or 0 if buf came from malloc */
+struct tn_lexer_src {
+	char *buf;
+	size_t mapped;
 };
 
-struct tn_token *tn_lexer_tokenize (const char *src, struct tn_token **last);
-struct tn_token *tn_lexer_tokenize_file (FILE *f);
-void tn_lexer_free_tokens (struct tn_token *tok);
+/* tokens are lexed on demand, as the parser asks for them, into a ring that's
+   refilled in batches, so there's never a whole token list in memory. a token
+   stays valid until a couple more have been read after it, so anything the
+   parser wants to keep longer than that has to be copied out. string literals are unescaped in place, so src has to
+   be writable, and stay around as long as they do */
+#define TN_LEXER_RING 64 // a power of two
+
+struct tn_lexer {
+	char *src;
+	int pos, len, error;
+	struct tn_token *tok; // ring[pos], which there always is
+	struct tn_token ring[TN_LEXER_RING];
+};
+
+void tn_lexer_init (struct tn_lexer *lx, char *src);
+void tn_lexer_fill (struct tn_lexer *lx, int n);
+int tn_lexer_read_file (FILE *f, struct tn_lexer_src *src);
+void tn_lexer_free_src (struct tn_lexer_src *src);
+
+// the parser peeks at the current token over and over, so that's kept at hand
+static inline struct tn_token *tn_lexer_peek (struct tn_lexer *lx, int n)
+{
+	if (!n)
+		return lx->tok;
+
+	if (lx->len <= n)
+		tn_lexer_fill (lx, n);
+
+	return &lx->ring[(lx->pos + n) & (TN_LEXER_RING - 1)];
+}
+
+static inline void tn_lexer_next (struct tn_lexer *lx)
+{
+	lx->pos = (lx->pos + 1) & (TN_LEXER_RING - 1);
+	lx->tok = &lx->ring[lx->pos];
+
+	if (!--lx->len)
+		tn_lexer_fill (lx, 0);
+}
 
 #endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 #include "error.h"
+#include "intern.h"
 #include "hash.h"
 #include "value.h"
 #include "gc.h"
@@ -8,35 +9,33 @@
 
 static void tn_list_map (struct tn_vm *vm, int argn)
 {
-	int i, anynil = 0, pushed = 0;
-	uint8_t gc_on = vm->gc->on;
-	struct tn_value *fn = vm->stack[vm->sp - 1], *ret = &nil, **tail = &ret;
-	struct tn_value **lists = &vm->stack[vm->sp - argn];
-	struct tn_scope *sc;
+	int i, top, anynil = 0, pushed = 0;
+	int lists = vm->sp - argn; // these stay on the stack until the end, which fn might grow
+	struct tn_value *fn = vm->stack[vm->sp - 1], *ret = &nil, *last = NULL, *val;
 
-	if (fn->type != VAL_CLSR && fn->type != VAL_CFUN) {
+	if (tn_type (fn) != VAL_CLSR && tn_type (fn) != VAL_CFUN) {
 		tn_error ("non-function function argument passed to list:map\n");
 		tn_vm_push (vm, &nil);
 		return;
 	}
 
 	for (i = 0; i < argn - 1; i++) {
-		if (lists[i]->type != VAL_PAIR) {
+		if (tn_type (vm->stack[lists + i]) != VAL_PAIR) {
 			tn_error ("non-list passed to list:map\n");
 			tn_vm_push (vm, &nil);
 			return;
 		}
 	}
 
-	vm->gc->on = 0; // disable the GC for this since it won't find a lot of the values we work on
+	top = tn_gc_root (vm->gc, &ret);
 
 	while (1) {
 		// push one value from each list passed, then increment the head of that list
 		for (i = argn - 2; i >= 0; i--) {
-			if (lists[i] != &nil) {
+			if (vm->stack[lists + i] != &nil) {
 				pushed++;
-				tn_vm_push (vm, lists[i]->data.pair.a);
-				lists[i] = lists[i]->data.pair.b;
+				tn_vm_push (vm, vm->stack[lists + i]->data.pair.a);
+				vm->stack[lists + i] = vm->stack[lists + i]->data.pair.b;
 			}
 			else {
 				anynil = 1;
@@ -48,63 +47,59 @@ static void tn_list_map (struct tn_vm *vm, int argn)
 		if (anynil)
 			break;
 
-		if (fn->type == VAL_CLSR) {
-			sc = vm->sc;
-			tn_vm_exec (vm, fn->data.cl->ch, fn, NULL, argn - 1);
-			vm->sc = sc;
-		}
-		else if (fn->type == VAL_CFUN)
-			fn->data.cfun (vm, argn - 1);
+		tn_vm_call (vm, fn, argn - 1);
 
 		pushed = 0;
 
-		*tail = tn_pair (vm, tn_vm_pop (vm), &nil);
-		tail = &(*tail)->data.pair.b;
+		// fn's return value is only popped once it's in the list
+		val = tn_value_lappend (vm, &ret, &last, vm->stack[vm->sp - 1]);
+		vm->sp--;
+
+		if (!val)
+			break;
 	}
 
+	tn_gc_unroot (vm->gc, top);
 	vm->sp -= argn;
 	tn_vm_push (vm, ret);
-	vm->gc->on = gc_on;
 }
 
 static void tn_list_foldl (struct tn_vm *vm, int argn)
 {
+	int top;
 	struct tn_value *fn, *lst, *init;
-	struct tn_scope *sc;
 
 	if (argn != 3 || tn_value_get_args (vm, "aaa", &fn, &lst, &init)
-	    || (fn->type != VAL_CLSR && fn->type != VAL_CFUN) || (lst != &nil && lst->type != VAL_PAIR)) {
+	    || (tn_type (fn) != VAL_CLSR && tn_type (fn) != VAL_CFUN) || (lst != &nil && tn_type (lst) != VAL_PAIR)) {
 		tn_error ("invalid arguments passed to list:foldl\n");
 		tn_vm_push (vm, &nil);
 		return;
 	}
 
 	tn_vm_push (vm, init);
+	top = tn_gc_root (vm->gc, &fn);
+	tn_gc_root (vm->gc, &lst);
 
 	// call fn on each node in the list, along with init
 	// the return value will be used as init for the next iteration
 	while (lst != &nil) {
 		tn_vm_push (vm, lst->data.pair.a);
 
-		if (fn->type == VAL_CLSR) {
-			sc = vm->sc;
-			tn_vm_exec (vm, fn->data.cl->ch, fn, NULL, argn - 1);
-			vm->sc = sc;
-		}
-		else if (fn->type == VAL_CFUN)
-			fn->data.cfun (vm, 2);
+		tn_vm_call (vm, fn, 2);
 
 		lst = lst->data.pair.b;
 	}
+
+	tn_gc_unroot (vm->gc, top);
 }
 
 static void tn_list_foldr (struct tn_vm *vm, int argn)
 {
+	int top;
 	struct tn_value *fn, *lst, *init;
-	struct tn_scope *sc;
 
 	if (argn != 3 || tn_value_get_args (vm, "aaa", &fn, &lst, &init)
-	    || (fn->type != VAL_CLSR && fn->type != VAL_CFUN) || (lst != &nil && lst->type != VAL_PAIR)) {
+	    || (tn_type (fn) != VAL_CLSR && tn_type (fn) != VAL_CFUN) || (lst != &nil && tn_type (lst) != VAL_PAIR)) {
 		tn_error ("invalid arguments passed to list:foldr\n");
 		tn_vm_push (vm, &nil);
 		return;
@@ -113,6 +108,9 @@ static void tn_list_foldr (struct tn_vm *vm, int argn)
 	tn_vm_push (vm, init);
 
 	if (lst != &nil) {
+		top = tn_gc_root (vm->gc, &fn);
+		tn_gc_root (vm->gc, &lst);
+
 		// call foldr on the tail of lst
 		tn_vm_push (vm, lst->data.pair.b);
 		tn_vm_push (vm, fn);
@@ -121,53 +119,41 @@ static void tn_list_foldr (struct tn_vm *vm, int argn)
 		// call fn on the head of lst and the return value of foldr
 		tn_vm_push (vm, lst->data.pair.a);
 
-		if (fn->type == VAL_CLSR) {
-			sc = vm->sc;
-			tn_vm_exec (vm, fn->data.cl->ch, fn, NULL, argn - 1);
-			vm->sc = sc;
-		}
-		else if (fn->type == VAL_CFUN)
-			fn->data.cfun (vm, 2);
+		tn_vm_call (vm, fn, 2);
+		tn_gc_unroot (vm->gc, top);
 	}
 }
 
 static void tn_list_filter (struct tn_vm *vm, int argn)
 {
-	uint8_t gc_on = vm->gc->on;
+	int top;
 	struct tn_value *fn, *lst;
-	struct tn_value *ret = &nil, **tail = &ret;
-	struct tn_scope *sc;
+	struct tn_value *ret = &nil, *last = NULL;
 
 	if (argn != 2 || tn_value_get_args (vm, "aa", &fn, &lst)
-	    || (fn->type != VAL_CLSR && fn->type != VAL_CFUN) || (lst != &nil && lst->type != VAL_PAIR)) {
+	    || (tn_type (fn) != VAL_CLSR && tn_type (fn) != VAL_CFUN) || (lst != &nil && tn_type (lst) != VAL_PAIR)) {
 		tn_error ("invalid arguments passed to list:filter\n");
 		tn_vm_push (vm, &nil);
 		return;
 	}
 
-	vm->gc->on = 0;
+	top = tn_gc_root (vm->gc, &fn);
+	tn_gc_root (vm->gc, &lst);
+	tn_gc_root (vm->gc, &ret);
 
 	while (lst != &nil) {
 		tn_vm_push (vm, lst->data.pair.a);
 
-		if (fn->type == VAL_CLSR) {
-			sc = vm->sc;
-			tn_vm_exec (vm, fn->data.cl->ch, fn, NULL, 1);
-			vm->sc = sc;
-		}
-		else if (fn->type == VAL_CFUN)
-			fn->data.cfun (vm, argn - 1);
+		tn_vm_call (vm, fn, argn - 1);
 
-		if (tn_value_true (tn_vm_pop (vm))) {
-			*tail = tn_pair (vm, lst->data.pair.a, &nil);
-			tail = &(*tail)->data.pair.b;
-		}
+		if (tn_value_true (tn_vm_pop (vm)) && !tn_value_lappend (vm, &ret, &last, lst->data.pair.a))
+			break;
 
 		lst = lst->data.pair.b;
 	}
 
+	tn_gc_unroot (vm->gc, top);
 	tn_vm_push (vm, ret);
-	vm->gc->on = gc_on;
 }
 
 static void tn_list_length (struct tn_vm *vm, int argn)
@@ -220,12 +206,14 @@ static void tn_list_join (struct tn_vm *vm, int argn)
 
 	ret = tn_value_lcopy (vm, a, &last);
 	last->data.pair.b = b;
+	tn_gc_barrier (vm->gc, last, b);
 
 	tn_vm_push (vm, ret);
 }
 
 static void tn_list_reverse (struct tn_vm *vm, int argn)
 {
+	int top;
 	struct tn_value *lst, *tail = &nil;
 
 	if (argn != 1 || tn_value_get_args (vm, "l", &lst)) {
@@ -234,12 +222,17 @@ static void tn_list_reverse (struct tn_vm *vm, int argn)
 		return;
 	}
 
+	top = tn_gc_root (vm->gc, &lst);
+	tn_gc_root (vm->gc, &tail);
+
 	while (lst != &nil) {
-		tail = tn_gc_preserve (tn_pair (vm, lst->data.pair.a, tail));
+		if (!(tail = tn_pair (vm, lst->data.pair.a, tail)))
+			break;
+
 		lst = lst->data.pair.b;
 	}
 
-	tn_gc_release_list (tail);
+	tn_gc_unroot (vm->gc, top);
 	tn_vm_push (vm, tail);
 }
 
@@ -247,14 +240,14 @@ struct tn_hash *tn_list_module (struct tn_vm *vm)
 {
 	struct tn_hash *ret = tn_hash_new (8);
 
-	tn_hash_insert (ret, "map", tn_gc_preserve (tn_cfun (vm, tn_list_map)));
-	tn_hash_insert (ret, "foldl", tn_gc_preserve (tn_cfun (vm, tn_list_foldl)));
-	tn_hash_insert (ret, "foldr", tn_gc_preserve (tn_cfun (vm, tn_list_foldr)));
-	tn_hash_insert (ret, "filter", tn_gc_preserve (tn_cfun (vm, tn_list_filter)));
-	tn_hash_insert (ret, "length", tn_gc_preserve (tn_cfun (vm, tn_list_length)));
-	tn_hash_insert (ret, "ref", tn_gc_preserve (tn_cfun (vm, tn_list_ref)));
-	tn_hash_insert (ret, "join", tn_gc_preserve (tn_cfun (vm, tn_list_join)));
-	tn_hash_insert (ret, "reverse", tn_gc_preserve (tn_cfun (vm, tn_list_reverse)));
+	tn_hash_insert (ret, tn_intern ("map"), tn_cfun_const (tn_list_map));
+	tn_hash_insert (ret, tn_intern ("foldl"), tn_cfun_const (tn_list_foldl));
+	tn_hash_insert (ret, tn_intern ("foldr"), tn_cfun_const (tn_list_foldr));
+	tn_hash_insert (ret, tn_intern ("filter"), tn_cfun_const (tn_list_filter));
+	tn_hash_insert (ret, tn_intern ("length"), tn_cfun_const (tn_list_length));
+	tn_hash_insert (ret, tn_intern ("ref"), tn_cfun_const (tn_list_ref));
+	tn_hash_insert (ret, tn_intern ("join"), tn_cfun_const (tn_list_join));
+	tn_hash_insert (ret, tn_intern ("reverse"), tn_cfun_const (tn_list_reverse));
 
 	return ret;
 }
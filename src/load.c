@@ -1,44 +1,77 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "error.h"
+#include "arena.h"
 #include "lexer.h"
 #include "parser.h"
 #include "gen.h"
+#include "decode.h"
+#include "value.h"
+#include "gc.h"
 #include "vm.h"
 
-struct tn_chunk *tn_load_tokens (struct tn_token *tok, struct tn_chunk_vars *vars)
+/* the chunk that's returned is owned by a VAL_CHUNK, and freed by the GC once
+   nothing refers to it. running it counts, so it can be run right away, but
+   anything else needs to keep ret->owner alive. the syntax tree has an arena
+   that goes as soon as it's compiled, and the byte code gets one of its own,
+   freed once it's decoded. open is passed on to tn_gen_fold */
+struct tn_chunk *tn_load_lexer (struct tn_vm *vm, struct tn_lexer *lx, struct tn_chunk_vars *vars, int open)
 {
+	int top, err;
+	struct tn_arena tree, code;
 	struct tn_expr *ast;
 	struct tn_chunk *ret;
-	struct tn_token *bak = tok;
+	struct tn_value *owner;
 
-	ast = tn_parser_body (&tok);
+	tn_arena_init (&tree);
+	ast = tn_parser_parse (&tree, lx);
 
-	if (!ast) {
-		tn_lexer_free_tokens (bak);
-		tn_error ("parsing failed\n");
+	if (!ast || lx->error) {
+		tn_arena_free (&tree);
+		tn_error (lx->error ? "lexing failed\n" : "parsing failed\n");
 		return NULL;
 	}
 
-	ret = tn_gen_compile (ast, NULL, NULL, vars ? vars : NULL);
+	tn_gen_fold (&tree, ast, open);
 
-	tn_lexer_free_tokens (bak);
-	tn_parser_free (ast);
+	tn_arena_init (&code);
+	ret = tn_gen_compile (&code, ast, NULL, NULL, vars ? vars : NULL);
+	tn_arena_free (&tree);
 
 	if (!ret) {
+		tn_arena_free (&code);
 		tn_error ("compilation failed\n");
 		return NULL;
 	}
 
+	if (!(owner = tn_chunk (vm, ret))) {
+		tn_arena_free (&code);
+		tn_gen_free (ret);
+		return NULL;
+	}
+
+	ret->owner = owner;
+	top = tn_gc_root (vm->gc, &owner);
+	err = tn_decode (vm, ret);
+	tn_gc_unroot (vm->gc, top);
+	tn_arena_free (&code);
+
+	if (err) {
+		tn_error ("decoding failed\n");
+		return NULL;
+	}
+
 	return ret;
 }
 
-struct tn_chunk *tn_load_file (const char *path, struct tn_chunk_vars *vars)
+struct tn_chunk *tn_load_file (struct tn_vm *vm, const char *path, struct tn_chunk_vars *vars)
 {
 	FILE *f;
-	struct tn_chunk *ret;
-	struct tn_token *tok;
+	struct tn_chunk *ret = NULL;
+	struct tn_lexer_src src;
+	struct tn_lexer lx;
 
 	if (!strcmp (path, "-"))
 		f = stdin;
@@ -48,29 +81,34 @@ struct tn_chunk *tn_load_file (const char *path, struct tn_chunk_vars *vars)
 	if (!f)
 		return NULL;
 
-	tok = tn_lexer_tokenize_file (f);
-
-	if (!tok) {
-		tn_error ("lexing failed\n");
-		return NULL;
+	if (!tn_lexer_read_file (f, &src)) {
+		tn_lexer_init (&lx, src.buf);
+		ret = tn_load_lexer (vm, &lx, vars, 0);
 	}
-	
-	ret = tn_load_tokens (tok, vars);
-	ret->path = path;
+
+	if (f != stdin)
+		fclose (f);
+
+	tn_lexer_free_src (&src);
+
+	if (ret)
+		ret->path = strdup (path);
 
 	return ret;
 }
 
-struct tn_chunk *tn_load_string (const char *str, struct tn_chunk_vars *vars)
+struct tn_chunk *tn_load_string (struct tn_vm *vm, const char *str, struct tn_chunk_vars *vars)
 {
-	struct tn_token *tok;
-
-	tok = tn_lexer_tokenize (str, NULL);
+	struct tn_chunk *ret;
+	struct tn_lexer lx;
+	char *src = strdup (str); // the lexer writes to it
 
-	if (!tok) {
-		tn_error ("lexing failed\n");
+	if (!src)
 		return NULL;
-	}
 
-	return tn_load_tokens (tok, vars);
+	tn_lexer_init (&lx, src);
+	ret = tn_load_lexer (vm, &lx, vars, 1); // the REPL
+	free (src);
+
+	return ret;
 }
@@ -1,12 +1,13 @@
 #ifndef LOAD_H__
 #define LOAD_H__
 
+struct tn_vm;
 struct tn_chunk;
 struct tn_chunk_vars;
-struct tn_token;
+struct tn_lexer;
 
-struct tn_chunk *tn_load_tokens (struct tn_token *tok, struct tn_chunk_vars *vars);
-struct tn_chunk *tn_load_file (const char *path, struct tn_chunk_vars *vars);
-struct tn_chunk *tn_load_string (const char *str, struct tn_chunk_vars *vars);
+struct tn_chunk *tn_load_lexer (struct tn_vm *vm, struct tn_lexer *lx, struct tn_chunk_vars *vars, int open);
+struct tn_chunk *tn_load_file (struct tn_vm *vm, const char *path, struct tn_chunk_vars *vars);
+struct tn_chunk *tn_load_string (struct tn_vm *vm, const char *str, struct tn_chunk_vars *vars);
 
 #endif
@@ -1,10 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "error.h"
 #include "lexer.h"
 #include "parser.h"
 #include "gen.h"
+#include "value.h"
+#include "gc.h"
 #include "vm.h"
 #include "import.h"
 #include "load.h"
@@ -12,24 +16,29 @@
 int tn_builtin_init (struct tn_vm *vm);
 int main (int argc, char **argv)
 {
-	int repl = 0;
+	int repl = 0, arg = 1;
 	char line[4096];
 	struct tn_chunk *code = NULL;
-	struct tn_scope *sc = tn_vm_scope (1); // acts as a global scope for the REPL
-	struct tn_vm *vm = tn_vm_init (1024);
+	struct tn_value *env; // acts as a global scope for the REPL
+	struct tn_vm *vm = tn_vm_init (1024, NULL);
 
-	if (!sc) {
+	if (!vm || !(env = tn_vm_env (vm))) {
 		tn_error ("failed to allocate scope\n");
 		return 1;
 	}
 
+	tn_gc_root (vm->gc, &env);
 	tn_builtin_init (vm);
 	tn_import_set_path (".:~/.triton:/usr/share/triton");
 
-	if (argc > 1)
-		code = tn_load_file (argv[1], NULL);
+	// -O<level>, 0 to turn optimization off
+	for (; arg < argc && !strncmp (argv[arg], "-O", 2); arg++)
+		tn_gen_set_opt (argv[arg][2] ? atoi (argv[arg] + 2) : 2);
+
+	if (argc > arg)
+		code = tn_load_file (vm, argv[arg], NULL);
 	else if (!isatty (fileno (stdin)))
-		code = tn_load_file ("-", NULL);
+		code = tn_load_file (vm, "-", NULL);
 	else {
 		printf ("triton " GITVER "\n\n");
 		repl = 1;
@@ -38,12 +47,12 @@ int main (int argc, char **argv)
 	do {
 		if (code) {
 		//	tn_disasm (code);
-			tn_vm_exec (vm, code, NULL, sc, 0);
+			tn_vm_exec (vm, code, NULL, env, 0);
 
 			if (vm->error) {
 				vm->error = 0;
 				vm->sp = 0;
-				code = NULL; // TODO: free this
+				code = NULL; // the GC frees it
 				continue;
 			}
 
@@ -56,7 +65,7 @@ int main (int argc, char **argv)
 		if (repl) {
 			printf ("> ");
 			fgets (line, 4096, stdin);
-			code = tn_load_string (line, code ? code->vars : NULL);
+			code = tn_load_string (vm, line, code ? code->vars : NULL);
 		}
 	} while (repl);
 
@@ -28,12 +28,19 @@
 #define OP_NIL	0x18
 #define OP_GLOB	0x19
 #define OP_ARGS	0x1a
+#define OP_GSLT	0x1b // OP_GLOB with the slot resolved, only in decoded code
 #define OP_JMP	0x20 // jump instructions
 #define OP_JNZ	0x21
 #define OP_JZ	0x22
 #define OP_CALL	0x23
 #define OP_TCAL	0x24
 #define OP_RET	0x25
+#define OP_EQJZ	0x26 // a comparison and OP_JZ, fused by the peephole pass
+#define OP_NEQJZ	0x27
+#define OP_LTJZ	0x28
+#define OP_LTEJZ	0x29
+#define OP_GTJZ	0x2a
+#define OP_GTEJZ	0x2b
 #define OP_ACCS	0x30 // list/array/etc instructions
 #define OP_IDX	0x31
 #define OP_LSTS	0x32
@@ -2,22 +2,30 @@
 #include <stdlib.h>
 
 #include "error.h"
+#include "intern.h"
+#include "arena.h"
 #include "parser.h"
 #include "lexer.h"
 
-static int tn_parser_peek (struct tn_token **tok, enum tn_token_type type, int eat)
+struct tn_parser {
+	struct tn_lexer *lx;
+	struct tn_arena *arena;
+};
+
+static inline int tn_parser_peek (struct tn_parser *p, int n, enum tn_token_type type, int eat)
 {
-	if (*tok && (*tok)->type == type) {
-		if (eat) *tok = (*tok)->next;
+	if (tn_lexer_peek (p->lx, n)->type == type) {
+		if (eat) tn_lexer_next (p->lx);
 		return 1;
 	}
 
 	return 0;
 }
 
-static inline struct tn_expr *tn_parser_alloc ()
+// nodes come from the arena, so there's nothing to free when parsing fails part way through
+static inline struct tn_expr *tn_parser_alloc (struct tn_parser *p)
 {
-	struct tn_expr *ret = malloc (sizeof (*ret));
+	struct tn_expr *ret = tn_arena_alloc (p->arena, sizeof (*ret));
 
 	if (!ret) {
 		tn_error ("malloc failure\n");
@@ -30,109 +38,56 @@ static inline struct tn_expr *tn_parser_alloc ()
 	return ret;
 }
 
-// recursively free an invalid syntax tree
-void tn_parser_free (struct tn_expr *expr)
-{
-	if (!expr)
-		return;
-
-	switch (expr->type) {
-		case EXPR_ASSN:
-			tn_parser_free (expr->data.assn.expr);
-			break;
-		case EXPR_FN:
-			tn_parser_free (expr->data.fn.expr);
-			free (expr->data.fn.args);
-			break;
-		case EXPR_UOP:
-			tn_parser_free (expr->data.uop.expr);
-			break;
-		case EXPR_BOP:
-			tn_parser_free (expr->data.bop.left);
-			tn_parser_free (expr->data.bop.right);
-			break;
-		case EXPR_CALL:
-			tn_parser_free (expr->data.call.fn);
-			tn_parser_free (expr->data.call.args);
-			break;
-		case EXPR_IF:
-			tn_parser_free (expr->data.ifs.cond);
-			tn_parser_free (expr->data.ifs.t);
-			tn_parser_free (expr->data.ifs.f);
-			break;
-		case EXPR_ACCS:
-			tn_parser_free (expr->data.accs.expr);
-			break;
-		case EXPR_DO:
-			tn_parser_free (expr->data.expr);
-			break;
-		default: break;
-	}
-
-	tn_parser_free (expr->next);
-	free (expr);
-}
-
-// wrappers for tn_parser_peek
-#define accept(TYPE) tn_parser_peek (tok, TYPE, 1)
-#define peek(TYPE) tn_parser_peek (tok, TYPE, 0)
-#define peeknext(TYPE) tn_parser_peek (&((*tok)->next), TYPE, 0)
-
-int tn_parser_bop_check (struct tn_expr *expr)
-{
-	if (!expr)
-		return 0;
-
-	if (expr->type != EXPR_BOP)
-		return 1;
-
-	if (tn_parser_bop_check (expr->data.bop.left) && tn_parser_bop_check (expr->data.bop.right))
-		return 1;
-	else {
-		tn_parser_free (expr);
-		return 0;
-	}
-}
-
-struct tn_expr *tn_parser_fn (struct tn_token**);
-struct tn_expr *tn_parser_if (struct tn_token **);
-struct tn_expr *tn_parser_uop (struct tn_token**);
-struct tn_expr *tn_parser_factor (struct tn_token **tok)
+/* wrappers for tn_parser_peek. current is only good until a couple more tokens
+   have been accepted, see tn_lexer_peek */
+#define accept(TYPE) tn_parser_peek (p, 0, TYPE, 1)
+#define peek(TYPE) tn_parser_peek (p, 0, TYPE, 0)
+#define peeknext(TYPE) tn_parser_peek (p, 1, TYPE, 0)
+#define current() tn_lexer_peek (p->lx, 0)
+
+// once the lexer has given up, the parser just sees the input end early, which isn't worth reporting
+#define error(MSG) do { if (!p->lx->error) tn_error (MSG); } while (0)
+
+struct tn_expr *tn_parser_body (struct tn_parser*);
+struct tn_expr *tn_parser_fn (struct tn_parser*);
+struct tn_expr *tn_parser_if (struct tn_parser*);
+struct tn_expr *tn_parser_uop (struct tn_parser*);
+struct tn_expr *tn_parser_factor (struct tn_parser *p)
 {
 	// factor = (expr) | negate | ident [([args])] | int | float
-	struct tn_token *prev = *tok;
+	struct tn_token *prev = current ();
 	struct tn_expr *ret, *new;
 
 	ret = new = NULL;
 
 	if (accept (TOK_LPAR)) {
-		ret = tn_parser_if (tok);
+		ret = tn_parser_if (p);
 
 		if (!accept (TOK_RPAR)) {
-			tn_error ("expected ')'\n");
-			goto cleanup;
+			error ("expected ')'\n");
+			return NULL;
 		}
 	}
 	else if (accept (TOK_FN)) {
-		ret = tn_parser_fn (tok);
+		ret = tn_parser_fn (p);
 		if (!ret) {
-			tn_error ("expected function definition\n");
+			error ("expected function definition\n");
 			return NULL;
 		}
 	}
-	else if (ret = tn_parser_alloc (), accept (TOK_IDENT)) { // this keeps things concise, so whatever
+	else if (ret = tn_parser_alloc (p), accept (TOK_IDENT)) { // this keeps things concise, so whatever
 		if (accept (TOK_ASSN)) {
 			ret->type = EXPR_ASSN;
 			ret->data.assn.name = prev->data.s;
-			ret->data.assn.expr = tn_parser_if (tok);
+			ret->data.assn.expr = tn_parser_if (p);
 
 			if (!ret->data.assn.expr) {
-				tn_error ("expected expression after assignment operator\n");
-				goto cleanup;
+				error ("expected expression after assignment operator\n");
+				return NULL;
 			}
 
 			if (ret->data.assn.expr->type == EXPR_FN) // aaaaaa
-				ret->data.assn.expr->data.fn.name = prev->data.s;
+				ret->data.assn.expr->data.fn.name = ret->data.assn.name;
 		}
 		else {
 			ret->type = EXPR_IDENT;
@@ -141,10 +96,10 @@ struct tn_expr *tn_parser_factor (struct tn_token **tok)
 	}
 	else if (accept (TOK_DO)) {
 		ret->type = EXPR_DO;
-		ret->data.expr = tn_parser_body (tok);
+		ret->data.expr = tn_parser_body (p);
 
 		if (!ret->data.expr) {
-			tn_error ("expected body after \"do\"\n");
+			error ("expected body after \"do\"\n");
 			return NULL;
 		}
 	}
@@ -153,19 +108,19 @@ struct tn_expr *tn_parser_factor (struct tn_token **tok)
 		ret->data.expr = NULL;
 
 		while (!accept (TOK_RBRK)) {
-			new = tn_parser_if (tok);
+			new = tn_parser_if (p);
 
 			if (!new) {
-				tn_error ("expected expression in list\n");
-				goto cleanup;
+				error ("expected expression in list\n");
+				return NULL;
 			}
 
 			new->next = ret->data.expr;
 			ret->data.expr = new;
 
 			if (!accept (TOK_COMM) && !peek (TOK_RBRK)) {
-				tn_error ("unexpected end to list\n");
-				goto cleanup;
+				error ("unexpected end to list\n");
+				return NULL;
 			}
 		}
 	}
@@ -186,21 +141,21 @@ struct tn_expr *tn_parser_factor (struct tn_token **tok)
 		ret->data.nil = NULL;
 	}
 	else {
-		tn_error ("expected factor in expression\n");
-		goto cleanup;
+		error ("expected factor in expression\n");
+		return NULL;
 	}
 
 	// list access
 	while (accept (TOK_COL)) {
-		new = tn_parser_alloc ();
+		new = tn_parser_alloc (p);
 
 		new->type = EXPR_ACCS;
 		new->data.accs.expr = ret;
 
-		prev = *tok;
+		prev = current ();
 		if (!accept (TOK_IDENT)) {
-			tn_error ("expected identifier after accessor\n");
-			goto cleanup;
+			error ("expected identifier after accessor\n");
+			return NULL;
 		}
 
 		new->data.accs.item = prev->data.s;
@@ -208,40 +163,35 @@ struct tn_expr *tn_parser_factor (struct tn_token **tok)
 	}
 
 	return ret;
-
-cleanup:
-	tn_parser_free (new ? new : ret);
-	return NULL;
 }
 
-struct tn_expr *tn_parser_call (struct tn_token **tok)
+struct tn_expr *tn_parser_call (struct tn_parser *p)
 {
 	struct tn_expr *new, *ret, *args;
 
-	ret = tn_parser_factor (tok);
-	new = NULL;
+	ret = tn_parser_factor (p);
 
 	while (accept (TOK_LPAR)) {
-		new = tn_parser_alloc ();
+		new = tn_parser_alloc (p);
 
 		new->type = EXPR_CALL;
 		new->data.call.fn = ret;
 		new->data.call.args = NULL;
 
 		while (!accept (TOK_RPAR)) { // build argument list
-			args = tn_parser_if (tok);
+			args = tn_parser_if (p);
 
 			if (!args) {
-				tn_error ("expected expression in argument list\n");
-				goto cleanup;
+				error ("expected expression in argument list\n");
+				return NULL;
 			}
 
 			args->next = new->data.call.args;
 			new->data.call.args = args;
 
 			if (!accept (TOK_COMM) && !peek (TOK_RPAR)) {
-				tn_error ("unexpected end to argument list\n");
-				goto cleanup;
+				error ("unexpected end to argument list\n");
+				return NULL;
 			}
 		}
 
@@ -249,251 +199,181 @@ struct tn_expr *tn_parser_call (struct tn_token **tok)
 	}
 
 	return ret;
-
-cleanup:
-	tn_parser_free (new ? new : ret);
-	return NULL;
 }
 
-struct tn_expr *tn_parser_uop (struct tn_token **tok)
+struct tn_expr *tn_parser_uop (struct tn_parser *p)
 {
-	struct tn_token *op;
+	int op;
 	struct tn_expr *ret;
 
-	op = *tok;
+	op = current ()->type;
 	if (accept (TOK_SUB) || accept (TOK_EXCL)) {
-		ret = tn_parser_alloc ();
+		ret = tn_parser_alloc (p);
 
 		ret->type = EXPR_UOP;
-		ret->data.uop.expr = tn_parser_uop (tok);
-		ret->data.uop.op = op->type;
+		ret->data.uop.op = op;
+		ret->data.uop.expr = tn_parser_uop (p);
 
 		return ret->data.uop.expr ? ret : NULL;
 	}
 	else
-		return tn_parser_call (tok);
+		return tn_parser_call (p);
 }
 
-struct tn_expr *tn_parser_term (struct tn_token **tok)
-{
-	// term = factor [*|/|% term]
-	struct tn_token *op;
-	struct tn_expr *new, *ret;
-
-	ret = tn_parser_uop (tok);
-
-	while ((op = *tok) && (accept (TOK_MUL) || accept (TOK_DIV) || accept (TOK_MOD))) {
-		new = tn_parser_alloc ();
-
-		new->type = EXPR_BOP;
-		new->data.bop.left = ret;
-		new->data.bop.right = tn_parser_uop (tok);
-		new->data.bop.op = op->type;
-
-		ret = new;
-	}
+/* binding strength of each binary operator, 0 for anything that isn't one.
+   everything is left associative, apart from concatenation */
+static const char tn_parser_prec[TOK_STRING + 1] = {
+	[TOK_ANDL] = 1, [TOK_ORL] = 1,
+	[TOK_EQ] = 2, [TOK_NEQ] = 2, [TOK_LT] = 2, [TOK_LTE] = 2, [TOK_GT] = 2, [TOK_GTE] = 2,
+	[TOK_CAT] = 3, [TOK_LCAT] = 3,
+	[TOK_ADD] = 4, [TOK_SUB] = 4,
+	[TOK_MUL] = 5, [TOK_DIV] = 5, [TOK_MOD] = 5
+};
 
-	return tn_parser_bop_check (ret) ? ret : NULL;
-}
+#define TN_PARSER_PREC_CAT 3
 
-struct tn_expr *tn_parser_expr (struct tn_token **tok)
+// binary = uop [op binary], for operators binding at least as tightly as min
+struct tn_expr *tn_parser_binary (struct tn_parser *p, int min)
 {
-	// expr = term [+|- expr]
-	struct tn_token *op;
+	int op, prec;
 	struct tn_expr *new, *ret;
 
-	ret = tn_parser_term (tok);
+	ret = tn_parser_uop (p);
 
-	while ((op = *tok) && (accept (TOK_ADD) || accept (TOK_SUB))) {
-		new = tn_parser_alloc ();
+	while (ret && (prec = tn_parser_prec[op = current ()->type]) >= min) {
+		tn_lexer_next (p->lx);
 
-		new->type = EXPR_BOP;
-		new->data.bop.left = ret;
-		new->data.bop.right = tn_parser_term (tok);
-		new->data.bop.op = op->type;
-
-		ret = new;
-	}
-
-	return tn_parser_bop_check (ret) ? ret : NULL;
-}
-
-struct tn_expr *tn_parser_cat (struct tn_token **tok)
-{
-	// eq = expr [==|!= eq]
-	struct tn_token *op;
-	struct tn_expr *new, *ret;
-
-	ret = tn_parser_expr (tok);
-
-	op = *tok;
-	if (accept (TOK_CAT) || accept (TOK_LCAT)) {
-		new = tn_parser_alloc ();
+		if (!(new = tn_parser_alloc (p)))
+			return NULL;
 
 		new->type = EXPR_BOP;
 		new->data.bop.left = ret;
-		new->data.bop.right = tn_parser_cat (tok);
-		new->data.bop.op = op->type;
-
-		ret = new;
-	}
-
-	return tn_parser_bop_check (ret) ? ret : NULL;
-}
-
-struct tn_expr *tn_parser_cmp (struct tn_token **tok)
-{
-	// eq = expr [==|!= eq]
-	struct tn_token *op;
-	struct tn_expr *new, *ret;
-
-	ret = tn_parser_cat (tok);
+		new->data.bop.op = op;
+		new->data.bop.right = tn_parser_binary (p, prec == TN_PARSER_PREC_CAT ? prec : prec + 1);
 
-	while ((op = *tok) && (accept (TOK_EQ) || accept (TOK_NEQ) || accept (TOK_LT)
-	                    || accept (TOK_LTE) || accept (TOK_GT) || accept (TOK_GTE))) {
-		new = tn_parser_alloc ();
-
-		new->type = EXPR_BOP;
-		new->data.bop.left = ret;
-		new->data.bop.right = tn_parser_cat (tok);
-		new->data.bop.op = op->type;
+		if (!new->data.bop.right)
+			return NULL;
 
 		ret = new;
 	}
 
-	return tn_parser_bop_check (ret) ? ret : NULL;
+	return ret;
 }
 
-struct tn_expr *tn_parser_bool (struct tn_token **tok)
+// the argument list grows in place, since nothing else is allocated while it's being read
+static int tn_parser_add_arg (struct tn_parser *p, struct tn_expr_data_fn *fn, const char *name)
 {
-	// eq = expr [==|!= eq]
-	struct tn_token *op;
-	struct tn_expr *new, *ret;
-
-	ret = tn_parser_cmp (tok);
+	const char **args;
+	int max = fn->args_max ? fn->args_max * 2 : 4;
 
-	while ((op = *tok) && (accept (TOK_ANDL) || accept (TOK_ORL))) {
-		new = tn_parser_alloc ();
+	if (fn->args_num == fn->args_max) {
+		if (!(args = tn_arena_realloc (p->arena, fn->args, fn->args_max * sizeof (*args), max * sizeof (*args))))
+			return 1;
 
-		new->type = EXPR_BOP;
-		new->data.bop.left = ret;
-		new->data.bop.right = tn_parser_cmp (tok);
-		new->data.bop.op = op->type;
-
-		ret = new;
+		fn->args = args;
+		fn->args_max = max;
 	}
 
-	return tn_parser_bop_check (ret) ? ret : NULL;
+	fn->args[fn->args_num++] = name;
+	return 0;
 }
 
-struct tn_expr *tn_parser_body (struct tn_token**);
-struct tn_expr *tn_parser_fn (struct tn_token **tok)
+struct tn_expr *tn_parser_fn (struct tn_parser *p)
 {
 	// fn = [name] (args) top ;
 	struct tn_expr_data_fn *fn;
 	struct tn_token *prev;
-	struct tn_expr *ret = tn_parser_alloc ();
+	struct tn_expr *ret = tn_parser_alloc (p);
 
-	prev = *tok;
+	prev = current ();
 
 	// fn name (args) == name = fn (args)
 	if (accept (TOK_IDENT)) {
 		ret->type = EXPR_ASSN;
 		ret->data.assn.name = prev->data.s;
-		ret->data.assn.expr = tn_parser_fn (tok);
-		if (!ret->data.assn.expr) {
-			tn_parser_free (ret);
+		ret->data.assn.expr = tn_parser_fn (p);
+		if (!ret->data.assn.expr)
 			return NULL;
-		}
-		ret->data.assn.expr->data.fn.name = prev->data.s;
+		ret->data.assn.expr->data.fn.name = ret->data.assn.name;
 		return ret;
 	}
 
 	ret->type = EXPR_FN;
 	fn = &ret->data.fn;
+	fn->name = NULL; // set by whatever assigns it, if anything
 
 	if (!accept (TOK_LPAR)) {
-		tn_error ("expected argument list\n");
-		tn_parser_free (ret);
+		error ("expected argument list\n");
 		return NULL;
 	}
 
-	// check if the argument list actually specifies any variables
-	if (peek (TOK_IDENT))
-		array_init (fn->args);
-	else {
-		fn->args = NULL;
-		fn->args_num = 0;
-		fn->args_max = 0;
-	}
-
+	fn->args = NULL;
+	fn->args_num = 0;
+	fn->args_max = 0;
 	fn->varargs = 0;
 
-	prev = *tok;
+	prev = current ();
 	while (!accept (TOK_RPAR) && (accept (TOK_IDENT) || accept (TOK_LBRK))) { // build argument list
 		if (prev->type == TOK_LBRK) {
 			fn->varargs = 1;
-			prev = *tok;
+			prev = current ();
 			if (!accept (TOK_IDENT) || !accept (TOK_RBRK)) {
-				tn_error ("expected variadic argument\n");
-				tn_parser_free (ret);
+				error ("expected variadic argument\n");
 				return NULL;
 			}
 		}
 
-		array_add (fn->args, prev->data.s);
+		if (tn_parser_add_arg (p, fn, prev->data.s))
+			return NULL;
 
 		if (!accept (TOK_COMM) && !peek (TOK_RPAR)) {
-			tn_error ("expected argument list\n");
-			tn_parser_free (ret);
+			error ("expected argument list\n");
 			return NULL;
 		}
 
-		prev = *tok;
+		prev = current ();
 	}
 
-	if (!prev || prev->type != TOK_RPAR) {
-		tn_error ("unexpected end to argument list\n");
-		tn_parser_free (ret);
+	if (prev->type != TOK_RPAR) {
+		error ("unexpected end to argument list\n");
 		return NULL;
 	}
 
-	fn->expr = tn_parser_body (tok);
+	fn->expr = tn_parser_body (p);
 
 	if (!fn->expr) {
-		tn_error ("expected function body\n");
-		tn_parser_free (ret);
+		error ("expected function body\n");
 		return NULL;
 	}
 
 	return ret;
 }
 
-struct tn_expr *tn_parser_if (struct tn_token **tok)
+struct tn_expr *tn_parser_if (struct tn_parser *p)
 {
 	struct tn_expr *ret;
 
 	if (accept (TOK_IF)) {
-		ret = tn_parser_alloc ();
+		ret = tn_parser_alloc (p);
 
 		ret->type = EXPR_IF;
-		ret->data.ifs.cond = tn_parser_bool (tok);
-		ret->data.ifs.t = tn_parser_if (tok);
+		ret->data.ifs.cond = tn_parser_binary (p, 1);
+		ret->data.ifs.t = tn_parser_if (p);
 
 		if (accept (TOK_ELSE))
-			ret->data.ifs.f = tn_parser_if (tok);
+			ret->data.ifs.f = tn_parser_if (p);
 		else
 			ret->data.ifs.f = NULL;
 
 		return ret;
 	}
 	else
-		return tn_parser_bool (tok);
+		return tn_parser_binary (p, 1);
 }
 
 // top-level expression, used for source files, functions, do-statements
 // unlike basically everything else, this returns a list of struct tn_expr
-struct tn_expr *tn_parser_body (struct tn_token **tok)
+struct tn_expr *tn_parser_body (struct tn_parser *p)
 {
 	// top = fn | assn | expr [top]
 	struct tn_token *prev;
@@ -501,27 +381,23 @@ struct tn_expr *tn_parser_body (struct tn_token **tok)
 
 	ret = last = NULL;
 
-	while (*tok && !accept (TOK_SCOL) && !peek (TOK_COMM) && !peek (TOK_RPAR)) {
+	while (!peek (TOK_ZERO) && !accept (TOK_SCOL) && !peek (TOK_COMM) && !peek (TOK_RPAR)) {
 		if (accept (TOK_IMPT)) {
-			new = tn_parser_alloc ();
-			prev = *tok;
+			new = tn_parser_alloc (p);
+			prev = current ();
 
 			new->type = EXPR_IMPT;
-			if (accept (TOK_STRING))
-				new->data.s = prev->data.s;
-			else {
-				tn_error ("expected identifier after import\n");
-				tn_parser_free (ret);
+			// the name is a string literal, but it's bound like an identifier
+			if (!accept (TOK_STRING) || !(new->data.s = tn_intern (prev->data.s))) {
+				error ("expected identifier after import\n");
 				return NULL;
 			}
 		}
 		else
-			new = tn_parser_if (tok);
+			new = tn_parser_if (p);
 
-		if (!new) {
-			tn_parser_free (ret); // free what we have
+		if (!new)
 			return NULL;
-		}
 
 		if (last) {
 			last->next = new;
@@ -533,3 +409,11 @@ struct tn_expr *tn_parser_body (struct tn_token **tok)
 
 	return ret;
 }
+
+// the syntax tree is allocated from arena
+struct tn_expr *tn_parser_parse (struct tn_arena *arena, struct tn_lexer *lx)
+{
+	struct tn_parser p = { lx, arena };
+
+	return tn_parser_body (&p);
+}
@@ -51,8 +51,8 @@ struct tn_expr {
 	struct tn_expr *next;
 };
 
-struct tn_token;
-struct tn_expr *tn_parser_body (struct tn_token **tok);
-void tn_parser_free (struct tn_expr *expr);
+struct tn_lexer;
+struct tn_arena;
+struct tn_expr *tn_parser_parse (struct tn_arena *arena, struct tn_lexer *lx);
 
 #endif
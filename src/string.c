@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "error.h"
+#include "intern.h"
 #include "hash.h"
 #include "value.h"
 #include "gc.h"
@@ -76,8 +77,8 @@ struct tn_hash *tn_string_module (struct tn_vm *vm)
 {
 	struct tn_hash *ret = tn_hash_new (8);
 
-	tn_hash_insert (ret, "format", tn_gc_preserve (tn_cfun (vm, tn_string_format)));
-	tn_hash_insert (ret, "length", tn_gc_preserve (tn_cfun (vm, tn_string_length)));
+	tn_hash_insert (ret, tn_intern ("format"), tn_cfun_const (tn_string_format));
+	tn_hash_insert (ret, tn_intern ("length"), tn_cfun_const (tn_string_length));
 
 	return ret;
 }
@@ -8,8 +8,8 @@
 #include "gc.h"
 #include "vm.h"
 
-struct tn_value nil = { VAL_NIL, { 0 } };
-struct tn_value lststart = { VAL_NIL, { 0 } };
+struct tn_value nil = { .type = VAL_NIL, .flags = GC_STATIC };
+struct tn_value lststart = { .type = VAL_NIL, .flags = GC_STATIC };
 
 struct tn_value *tn_value_new (struct tn_vm *vm, enum tn_val_type type, union tn_val_data data)
 {
@@ -20,9 +20,31 @@ struct tn_value *tn_value_new (struct tn_vm *vm, enum tn_val_type type, union tn
 		return NULL;
 	}
 
+	// tn_gc_alloc already set the flags
 	ret->type = type;
 	ret->data = data;
-	ret->flags = 0;
+
+	if (type == VAL_STR)
+		vm->gc->stats.payload += strlen (data.s) + 1;
+
+	return ret;
+}
+
+/* constants live outside of the GC heap, the GC never frees them and they're
+   never modified. they're only for the cfuns and cvals of C modules, see
+   tn_cfun_const, which live as long as the VM */
+struct tn_value *tn_value_const (enum tn_val_type type, union tn_val_data data)
+{
+	struct tn_value *ret = malloc (sizeof (*ret));
+
+	if (!ret) {
+		tn_error ("malloc failed\n");
+		return NULL;
+	}
+
+	ret->type = type;
+	ret->data = data;
+	ret->flags = GC_STATIC;
 
 	return ret;
 }
@@ -32,9 +54,9 @@ int tn_value_true (struct tn_value *v)
 	if (!v)
 		return 0;
 
-	switch (v->type) {
+	switch (tn_type (v)) {
 		case VAL_NIL: return 0;
-		case VAL_INT: return !!v->data.i;
+		case VAL_INT: return !!tn_intval (v);
 		case VAL_PAIR: return 1;
 		default: return 0;
 	}
@@ -49,7 +71,7 @@ struct tn_value *tn_value_cat (struct tn_vm *vm, struct tn_value *a, struct tn_v
 {
 	char *buf;
 
-	if (a->type == VAL_STR && b->type == VAL_STR) {
+	if (tn_type (a) == VAL_STR && tn_type (b) == VAL_STR) {
 		buf = malloc (strlen (a->data.s) + strlen (b->data.s) + 1);
 		if (!buf) {
 			tn_error ("malloc failed\n");
@@ -69,22 +91,41 @@ struct tn_value *tn_value_cat (struct tn_vm *vm, struct tn_value *a, struct tn_v
 	return NULL;
 }
 
+/* adds val to the end of *lst, where *last is its last pair. the caller roots
+   *lst and val, since this allocates. returns NULL on failure */
+struct tn_value *tn_value_lappend (struct tn_vm *vm, struct tn_value **lst, struct tn_value **last, struct tn_value *val)
+{
+	struct tn_value *pair = tn_pair (vm, val, &nil);
+
+	if (!pair)
+		return NULL;
+
+	if (*lst == &nil)
+		*lst = pair;
+	else {
+		(*last)->data.pair.b = pair;
+		tn_gc_barrier (vm->gc, *last, pair);
+	}
+
+	*last = pair;
+	return pair;
+}
+
 struct tn_value *tn_value_lcopy (struct tn_vm *vm, struct tn_value *lst, struct tn_value **last)
 {
-	uint8_t gc_on = vm->gc->on;
-	struct tn_value *ret = &nil, **tail = &ret;
+	struct tn_value *ret = &nil;
+	int top = tn_gc_root (vm->gc, &lst);
 
-	vm->gc->on = 0;
+	tn_gc_root (vm->gc, &ret);
 
 	while (lst != &nil) {
-		*tail = tn_pair (vm, lst->data.pair.a, &nil);
-		*last = *tail;
-		tail = &(*tail)->data.pair.b;
+		if (!tn_value_lappend (vm, &ret, last, lst->data.pair.a))
+			break;
 
 		lst = lst->data.pair.b;
 	}
 
-	vm->gc->on = gc_on;
+	tn_gc_unroot (vm->gc, top);
 	return ret;
 }
 
@@ -92,13 +133,15 @@ struct tn_value *tn_value_lcopy (struct tn_vm *vm, struct tn_value *lst, struct
 struct tn_value *tn_value_lcat (struct tn_vm *vm, struct tn_value *a, struct tn_value *b)
 {
 	struct tn_value *ret;
+	int top;
 
 	// to make this a proper list, we need the second element to be a pair too
-	// this requires a bit of working with the GC
-	if (b != &nil && b->type != VAL_PAIR) {
-		b = tn_gc_preserve (tn_pair (vm, b, &nil));
+	if (b != &nil && tn_type (b) != VAL_PAIR) {
+		top = tn_gc_root (vm->gc, &a);
+		b = tn_pair (vm, b, &nil);
+		tn_gc_root (vm->gc, &b);
 		ret = tn_pair (vm, a, b);
-		tn_gc_release (b);
+		tn_gc_unroot (vm->gc, top);
 
 		return ret;
 	}
@@ -106,33 +149,37 @@ struct tn_value *tn_value_lcat (struct tn_vm *vm, struct tn_value *a, struct tn_
 	return tn_pair (vm, a, b);
 }
 
+/* builds a list out of the top n values on the stack, with the top one first.
+   they stay on the stack until the list is done, so the GC can see them */
 struct tn_value *tn_value_lcon (struct tn_vm *vm, int n)
 {
-	struct tn_value *val;
+	struct tn_value *ret = &nil;
+	int i, top = tn_gc_root (vm->gc, &ret);
 
-	if (n == 0)
-		return &nil;
+	for (i = vm->sp - n; i < vm->sp; i++) {
+		if (!(ret = tn_pair (vm, vm->stack[i], ret)))
+			break;
+	}
 
-	val = tn_gc_preserve (tn_vm_pop (vm));
-	val = tn_pair (vm, val, tn_value_lcon (vm, n - 1));
-	tn_gc_release (val->data.pair.a);
+	tn_gc_unroot (vm->gc, top);
+	vm->sp -= n;
 
-	return val;
+	return ret;
 }
 
+// builds a list out of everything on the stack down to lststart
 struct tn_value *tn_value_lste (struct tn_vm *vm)
 {
-	struct tn_value *tail, *val = tn_vm_pop (vm);
+	struct tn_value *ret;
+	int n = 0;
 
-	if (val == &lststart)
-		return &nil;
+	while (vm->stack[vm->sp - n - 1] != &lststart)
+		n++;
 
-	tn_gc_preserve (val);
-	tail = tn_value_lste (vm);
-	val = tn_pair (vm, val, tail);
-	tn_gc_preserve (val);
+	ret = tn_value_lcon (vm, n);
+	vm->sp--; // lststart
 
-	return val;
+	return ret;
 }
 
 char *tn_value_string (struct tn_value *val)
@@ -140,15 +187,15 @@ char *tn_value_string (struct tn_value *val)
 	char *ret = NULL, *old, *tmp;
 	struct tn_value *it;
 
-	switch (val->type) {
+	switch (tn_type (val)) {
 		case VAL_NIL:
 			asprintf (&ret, "nil");
 			break;
 		case VAL_INT:
-			asprintf (&ret, "%i", val->data.i);
+			asprintf (&ret, "%i", tn_intval (val));
 			break;
 		case VAL_DBL:
-			asprintf (&ret, "%g", val->data.d);
+			asprintf (&ret, "%g", tn_dblval (val));
 			break;
 		case VAL_STR:
 			asprintf (&ret, "%s", val->data.s);
@@ -172,7 +219,7 @@ char *tn_value_string (struct tn_value *val)
 			free (old);
 			break;
 		case VAL_CLSR:
-			asprintf (&ret, "closure:0x%lx", (uint64_t)val->data.cl);
+			asprintf (&ret, "closure:0x%lx", (uint64_t)val);
 			break;
 		case VAL_CFUN:
 			asprintf (&ret, "cfun:0x%lx", (uint64_t)val->data.cfun);
@@ -184,12 +231,10 @@ char *tn_value_string (struct tn_value *val)
 			asprintf (&ret, "cval:0x%lx", (uint64_t)val->data.cval.v);
 			break;
 		case VAL_SCOPE:
-			asprintf (&ret, "scope:0x%lx", (uint64_t)val->data.sc);
+			asprintf (&ret, "scope:0x%lx", (uint64_t)val->data.env.vars);
 			break;
-		case VAL_REF:
-			tmp = tn_value_string (*val->data.ref);
-			asprintf (&ret, "ref:%s", tmp);
-			free (tmp);
+		case VAL_CHUNK:
+			asprintf (&ret, "chunk:0x%lx", (uint64_t)val->data.ch);
 			break;
 		default: break;
 	}
@@ -215,25 +260,25 @@ int tn_value_get_args (struct tn_vm *vm, const char *types, ...)
 			case 'i': {
 				int *i = va_arg (va, int*);
 
-				if (val->type != VAL_INT)
+				if (tn_type (val) != VAL_INT)
 					goto error;
 
-				*i = val->data.i;
+				*i = tn_intval (val);
 				break;
 			}
 			case 'd': {
 				double *d = va_arg (va, double*);
 
-				if (val->type != VAL_DBL)
+				if (tn_type (val) != VAL_DBL)
 					goto error;
 
-				*d = val->data.d;
+				*d = tn_dblval (val);
 				break;
 			}
 			case 's': {
 				char **s = va_arg (va, char**);
 
-				if (val->type != VAL_STR)
+				if (tn_type (val) != VAL_STR)
 					goto error;
 
 				*s = val->data.s;
@@ -242,20 +287,20 @@ int tn_value_get_args (struct tn_vm *vm, const char *types, ...)
 			case 'v': { // C value
 				void **v = va_arg (va, void**);
 
-				if (val->type != VAL_CVAL)
+				if (tn_type (val) != VAL_CVAL)
 					goto error;
 
 				*v = val->data.cval.v;
 				break;
 			}
 			case 'l': // list
-				if (val->type != VAL_PAIR)
+				if (tn_type (val) != VAL_PAIR)
 					goto error;
 			case 'c': // closure
-				if (*types == 'c' && val->type != VAL_CLSR)
+				if (*types == 'c' && tn_type (val) != VAL_CLSR)
 					goto error;
 			case 'C': // C function
-				if (*types == 'C' && val->type != VAL_CFUN)
+				if (*types == 'C' && tn_type (val) != VAL_CFUN)
 					goto error;
 			case 'a': { // any value
 				struct tn_value **v = va_arg (va, struct tn_value**);
@@ -4,16 +4,18 @@
 #include <stdint.h>
 
 struct tn_hash;
-struct tn_closure;
-struct tn_scope;
+struct tn_chunk;
+struct tn_scope_vars;
 struct tn_vm;
 struct tn_value {
 	enum tn_val_type {
 		VAL_NIL, VAL_IDENT, VAL_INT, VAL_DBL, VAL_STR,
 		VAL_PAIR, VAL_CLSR, VAL_CFUN, VAL_CMOD, VAL_CVAL,
-		VAL_SCOPE, VAL_REF
+		VAL_SCOPE, VAL_CHUNK
 	} type;
 
+	uint8_t flags; // for the GC
+
 	union tn_val_data {
 		int i;
 		double d;
@@ -21,37 +23,143 @@ struct tn_value {
 		struct {
 			struct tn_value *a, *b;
 		} pair;
-		struct tn_closure *cl;
+		struct tn_closure {
+			struct tn_chunk *ch;
+			struct tn_value *env; // VAL_SCOPE it was created in
+		} cl;
 		void (*cfun)(struct tn_vm *vm, int nargs);
 		struct tn_hash *cmod;
 		struct {
 			void *v;
 			void (*free)(void *v);
 		} cval;
-		struct tn_scope *sc;
-		struct tn_value **ref;
+		struct {
+			struct tn_scope_vars *vars;
+			struct tn_value *up; // enclosing scope
+		} env;
+		struct tn_chunk *ch; // the root of a chunk tree, see tn_chunk.owner
 	} data;
-
-	struct tn_value *next; // for GC
-	uint8_t flags;
 };
 
+/* ints and most doubles are stored directly in the struct tn_value pointer
+   instead of being allocated. real values are at least 4-byte aligned, so the
+   bottom two bits of the pointer tell them apart:
+     ...x1 - int, stored in the upper bits
+     ...10 - double, packed the same way as ruby's "flonums". this only works
+             with 64-bit pointers, and only covers exponents roughly between
+             -255 and 256, so anything else still ends up on the heap
+     ...00 - pointer to an actual struct tn_value
+   nil is a static value, so it never touches the heap either.
+   always go through tn_type/tn_intval/tn_dblval, never v->type or v->data */
+#define TN_TAG_INT	1
+#define TN_TAG_DBL	2
+#define TN_TAG_MASK	3
+
+#define tn_is_imm(V) ((uintptr_t)(V) & TN_TAG_MASK)
+
+#if INTPTR_MAX > INT32_MAX
+#define TN_INT_FITS(I) 1
+#else
+#define TN_INT_FITS(I) ((I) >= -(1 << 30) && (I) < (1 << 30))
+#endif
+
+#if UINTPTR_MAX == UINT64_MAX
+#define TN_FLONUM
+#define TN_FLONUM_ZERO (((uint64_t)1 << 63) | TN_TAG_DBL)
+#endif
+
 #define VAL(VM, TYPE, DEF) tn_value_new (VM, TYPE, ((union tn_val_data) { DEF }))
-#define tn_int(VM, I) VAL (VM, VAL_INT, .i = I)
-#define tn_double(VM, D) VAL (VM, VAL_DBL, .d = D)
+#define tn_int(VM, I) tn_value_int (VM, I)
+#define tn_double(VM, D) tn_value_double (VM, D)
 #define tn_string(VM, S) VAL (VM, VAL_STR, .s = S)
 #define tn_pair(VM, A, B) tn_value_new (VM, VAL_PAIR, ((union tn_val_data) { .pair = { A, B } }))
-#define tn_closure(VM, CL) VAL (VM, VAL_CLSR, .cl = CL)
+#define tn_closure(VM, CH, ENV) tn_value_new (VM, VAL_CLSR, ((union tn_val_data) { .cl = { CH, ENV } }))
 #define tn_cfun(VM, FN) VAL (VM, VAL_CFUN, .cfun = FN)
 #define tn_cmod(VM, MOD) VAL (VM, VAL_CMOD, .cmod = MOD)
 #define tn_cval(VM, V, FREE) tn_value_new (VM, VAL_CVAL, ((union tn_val_data) { .cval = { V, FREE } }))
-#define tn_scope(VM, SC) VAL (VM, VAL_SCOPE, .sc = SC)
-#define tn_vref(VM, R) VAL (VM, VAL_REF, .ref = R)
+#define tn_scope(VM, VARS, UP) tn_value_new (VM, VAL_SCOPE, ((union tn_val_data) { .env = { VARS, UP } }))
+#define tn_chunk(VM, CH) VAL (VM, VAL_CHUNK, .ch = CH)
+
+// for values that live as long as the VM, like the functions in a C module
+#define tn_cfun_const(FN) tn_value_const (VAL_CFUN, ((union tn_val_data) { .cfun = FN }))
+#define tn_cval_const(V, FREE) tn_value_const (VAL_CVAL, ((union tn_val_data) { .cval = { V, FREE } }))
 
 struct tn_value *tn_value_new (struct tn_vm *vm, enum tn_val_type type, union tn_val_data data);
+struct tn_value *tn_value_const (enum tn_val_type type, union tn_val_data data);
+
+static inline enum tn_val_type tn_type (struct tn_value *v)
+{
+	if ((uintptr_t)v & TN_TAG_INT)
+		return VAL_INT;
+	else if ((uintptr_t)v & TN_TAG_DBL)
+		return VAL_DBL;
+
+	return v->type;
+}
+
+static inline struct tn_value *tn_value_int (struct tn_vm *vm, int i)
+{
+	if (TN_INT_FITS (i))
+		return (struct tn_value*)(((uintptr_t)(intptr_t)i << 1) | TN_TAG_INT);
+
+	return VAL (vm, VAL_INT, .i = i);
+}
+
+static inline int tn_intval (struct tn_value *v)
+{
+	if ((uintptr_t)v & TN_TAG_INT)
+		return (int)((intptr_t)v >> 1);
+
+	return v->data.i;
+}
+
+// returns NULL if d can't be stored as an immediate
+static inline struct tn_value *tn_value_flonum (double d)
+{
+#ifdef TN_FLONUM
+	union { double d; uint64_t u; } t = { .d = d };
+	int bits = (t.u >> 60) & 7;
+
+	// bits 62-60 of the exponent need to be 011 or 100, the rest can be dropped
+	if (t.u != 0x3000000000000000 && (bits == 3 || bits == 4))
+		return (struct tn_value*)(((t.u << 3 | t.u >> 61) & ~(uint64_t)1) | TN_TAG_DBL);
+	else if (t.u == 0)
+		return (struct tn_value*)TN_FLONUM_ZERO;
+#endif
+
+	return NULL;
+}
+
+static inline struct tn_value *tn_value_double (struct tn_vm *vm, double d)
+{
+	struct tn_value *ret = tn_value_flonum (d);
+	return ret ? ret : VAL (vm, VAL_DBL, .d = d);
+}
+
+static inline double tn_dblval (struct tn_value *v)
+{
+#ifdef TN_FLONUM
+	if ((uintptr_t)v & TN_TAG_DBL) {
+		union { double d; uint64_t u; } t;
+		uint64_t u = (uintptr_t)v;
+
+		if (u == TN_FLONUM_ZERO)
+			return 0.0;
+
+		// restore the two exponent bits we dropped from the original bit 60
+		u = (2 - (u >> 63)) | (u & ~(uint64_t)TN_TAG_MASK);
+		t.u = u >> 3 | u << 61;
+		return t.d;
+	}
+#endif
+
+	return v->data.d;
+}
+
 int tn_value_true (struct tn_value *v);
 int tn_value_false (struct tn_value *v);
 struct tn_value *tn_value_cat (struct tn_vm *vm, struct tn_value *a, struct tn_value *b);
+struct tn_value *tn_value_lappend (struct tn_vm *vm, struct tn_value **lst, struct tn_value **last, struct tn_value *val);
 struct tn_value *tn_value_lcopy (struct tn_vm *vm, struct tn_value *lst, struct tn_value **last);
 struct tn_value *tn_value_lcat (struct tn_vm *vm, struct tn_value *a, struct tn_value *b);
 struct tn_value *tn_value_lcon (struct tn_vm *vm, int n);
@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "error.h"
+#include "intern.h"
 #include "hash.h"
 #include "opcode.h"
 #include "parser.h"
@@ -13,70 +14,6 @@
 #include "gc.h"
 #include "import.h"
 
-static inline uint8_t tn_vm_read8 (struct tn_vm *vm)
-{
-	return vm->sc->ch->code[vm->sc->pc++];
-}
-
-static uint16_t tn_vm_read16 (struct tn_vm *vm)
-{
-	uint16_t i;
-
-	i = vm->sc->ch->code[vm->sc->pc++];
-	i |= vm->sc->ch->code[vm->sc->pc++] << 8;
-
-	return i;
-}
-
-static uint32_t tn_vm_read32 (struct tn_vm *vm)
-{
-	uint32_t i;
-
-	i = vm->sc->ch->code[vm->sc->pc++];
-	i |= vm->sc->ch->code[vm->sc->pc++] << 8;
-	i |= vm->sc->ch->code[vm->sc->pc++] << 16;
-	i |= vm->sc->ch->code[vm->sc->pc++] << 24;
-
-	return i;
-}
-
-static uint64_t tn_vm_read64 (struct tn_vm *vm)
-{
-	uint64_t i;
-
-	i = vm->sc->ch->code[vm->sc->pc++];
-	i |= vm->sc->ch->code[vm->sc->pc++] << 8;
-	i |= vm->sc->ch->code[vm->sc->pc++] << 16;
-	i |= vm->sc->ch->code[vm->sc->pc++] << 24;
-	i |= (uint64_t)vm->sc->ch->code[vm->sc->pc++] << 32;
-	i |= (uint64_t)vm->sc->ch->code[vm->sc->pc++] << 40;
-	i |= (uint64_t)vm->sc->ch->code[vm->sc->pc++] << 48;
-	i |= (uint64_t)vm->sc->ch->code[vm->sc->pc++] << 56;
-
-	return i;
-}
-
-static double tn_vm_readdouble (struct tn_vm *vm)
-{
-	uint64_t u64 = tn_vm_read64 (vm);
-	double *d = (double*)&u64;
-	return *d;
-}
-
-static char *tn_vm_readstring (struct tn_vm *vm)
-{
-	uint16_t len;
-	char *ret;
-
-	len = tn_vm_read16 (vm);
-	ret = strndup ((char*)vm->sc->ch->code + vm->sc->pc, len);
-	if (!ret)
-		return NULL;
-
-	vm->sc->pc += len;
-	return ret;
-}
-
 void tn_vm_print (struct tn_value*);
 void tn_vm_push (struct tn_vm *vm, struct tn_value *val)
 {
@@ -116,10 +53,7 @@ struct tn_value *tn_vm_pop (struct tn_vm *vm)
 		return NULL;
 	}
 
-	if (vm->stack[--vm->sp]->type == VAL_REF)
-		return *vm->stack[vm->sp]->data.ref;
-
-	return vm->stack[vm->sp];
+	return vm->stack[--vm->sp];
 }
 
 void tn_vm_print (struct tn_value *val)
@@ -129,235 +63,394 @@ void tn_vm_print (struct tn_value *val)
 	free (str);
 }
 
+// ints are immediates, so the int/int case never touches the heap or fails
 #define numop(OP) { \
-	int v1i, v2i, v1d, v2d; \
+	enum tn_val_type t1, t2; \
 	v2 = tn_vm_pop (vm); \
 	v1 = tn_vm_pop (vm); \
-	v1i = (v1->type == VAL_INT); \
-	v2i = (v2->type == VAL_INT); \
-	v1d = (v1->type == VAL_DBL); \
-	v2d = (v2->type == VAL_DBL); \
-	if (v1i && v2i) \
-		tn_vm_push (vm, tn_int (vm, v1->data.i OP v2->data.i)); \
-	else if (v1d && v2d) \
-		tn_vm_push (vm, tn_double (vm, v1->data.d OP v2->data.d)); \
-	else if (v1i && v2d) \
-		tn_vm_push (vm, tn_double (vm, v1->data.i OP v2->data.d)); \
-	else if (v1d && v2i) \
-		tn_vm_push (vm, tn_double (vm, v1->data.d OP v2->data.i)); \
+	t1 = tn_type (v1); \
+	t2 = tn_type (v2); \
+	if (t1 == VAL_INT && t2 == VAL_INT) { \
+		tn_vm_push (vm, tn_int (vm, tn_intval (v1) OP tn_intval (v2))); \
+		NEXT; \
+	} \
+	else if (t1 == VAL_DBL && t2 == VAL_DBL) \
+		tn_vm_push (vm, tn_double (vm, tn_dblval (v1) OP tn_dblval (v2))); \
+	else if (t1 == VAL_INT && t2 == VAL_DBL) \
+		tn_vm_push (vm, tn_double (vm, tn_intval (v1) OP tn_dblval (v2))); \
+	else if (t1 == VAL_DBL && t2 == VAL_INT) \
+		tn_vm_push (vm, tn_double (vm, tn_dblval (v1) OP tn_intval (v2))); \
 	else { \
 		tn_error ("non-number passed to numeric operation\n"); \
-		vm->error = 1; \
+		goto error; \
 	} \
 } \
-break
+NEXT_CHECKED
 
-static struct tn_scope *tn_vm_scope_copy (struct tn_scope *sc)
+/* a comparison followed by OP_JZ. a comparison involving a double gives a
+   double, which is never true, so those always jump */
+#define cmpjz(OP) { \
+	enum tn_val_type t1, t2; \
+	v2 = tn_vm_pop (vm); \
+	v1 = tn_vm_pop (vm); \
+	t1 = tn_type (v1); \
+	t2 = tn_type (v2); \
+	if (t1 == VAL_INT && t2 == VAL_INT) { \
+		if (tn_intval (v1) OP tn_intval (v2)) \
+			ip++; \
+		else \
+			ip = ip->jmp; \
+		NEXT; \
+	} \
+	else if ((t1 == VAL_INT || t1 == VAL_DBL) && (t2 == VAL_INT || t2 == VAL_DBL)) { \
+		ip = ip->jmp; \
+		NEXT; \
+	} \
+	tn_error ("non-number passed to numeric operation\n"); \
+	goto error; \
+}
+
+static struct tn_scope_vars *tn_vm_vars_new (void)
 {
-	struct tn_scope *ret;
+	struct tn_scope_vars *ret = malloc (sizeof (*ret));
 
-	if (!sc)
+	if (!ret)
 		return NULL;
 
-	ret = malloc (sizeof (*ret));
+	array_init (ret->arr);
+	ret->ch = NULL;
 
-	if (!ret) {
-		tn_error ("malloc failed\n");
+	if (!ret->arr) {
+		free (ret);
 		return NULL;
 	}
 
-	ret->pc = sc->pc;
-	ret->ch = sc->ch;
-	ret->keep = sc->keep;
-	ret->vars = sc->vars;
-	ret->vars->refs++;
-	ret->next = tn_vm_scope_copy (sc->next);
-
 	return ret;
 }
 
-static struct tn_closure *tn_vm_closure (struct tn_vm *vm)
+// an empty scope for a module or the REPL to run in, see tn_vm_exec
+struct tn_value *tn_vm_env (struct tn_vm *vm)
 {
-	struct tn_closure *ret = malloc (sizeof (*ret));
+	struct tn_scope_vars *vars = tn_vm_vars_new ();
+	struct tn_value *ret;
 
-	if (!ret) {
+	if (!vars) {
 		tn_error ("malloc failed\n");
 		vm->error = 1;
 		return NULL;
 	}
 
-	ret->ch = vm->sc->ch->subch[tn_vm_read16 (vm)];
-	ret->sc = tn_vm_scope_copy (vm->sc);
-
-	if (!ret->sc) {
-		vm->error = 1;
-		return NULL;
+	if (!(ret = tn_scope (vm, vars, NULL))) {
+		free (vars->arr);
+		free (vars);
 	}
 
 	return ret;
 }
 
-struct tn_scope *tn_vm_scope (uint8_t keep)
+/* scopes that returned are recycled, and so are their variables unless they
+   were captured. a scope running in env uses env's variables instead */
+static struct tn_scope *tn_vm_scope_new (struct tn_vm *vm, struct tn_value *env)
 {
-	struct tn_scope *ret = malloc (sizeof (*ret));
-	struct tn_scope_vars *vars = malloc (sizeof (*vars));
+	struct tn_scope *ret = vm->scope_pool;
 
-	if (!ret || !vars)
-		goto error;
+	if (ret)
+		vm->scope_pool = ret->next;
+	else if ((ret = malloc (sizeof (*ret))))
+		ret->vars = NULL;
+	else
+		return NULL;
+
+	if (env) {
+		if (ret->vars) {
+			free (ret->vars->arr);
+			free (ret->vars);
+		}
 
-	ret->keep = keep;
-	ret->vars = vars;
-	array_init (ret->vars->arr);
-	ret->vars->refs = 1;
-	ret->next = NULL;
+		ret->vars = env->data.env.vars;
+	}
+	else if (!ret->vars && !(ret->vars = tn_vm_vars_new ())) {
+		ret->next = vm->scope_pool;
+		vm->scope_pool = ret;
+		return NULL;
+	}
 
-	if (!ret->vars->arr)
-		goto error;
+	ret->ip = NULL;
+	ret->ch = NULL;
+	ret->cl = NULL;
+	ret->env = env;
+	ret->up = env ? env->data.env.up : NULL;
+	ret->scanned = 0;
+	ret->next = ret->gc_next = NULL;
 
 	return ret;
+}
 
-error:
-	free (ret);
-	free (vars);
-	return NULL;
+static void tn_vm_free_scope (struct tn_vm *vm, struct tn_scope *sc)
+{
+	if (sc->env) {
+		/* the variables were written to without a barrier while this ran, and
+		   from now on they're only reachable through the VAL_SCOPE */
+		tn_gc_touch (vm->gc, sc->env);
+		sc->vars = NULL;
+	}
+	else {
+		memset (sc->vars->arr, 0, sc->vars->arr_num * sizeof (*sc->vars->arr));
+		sc->vars->arr_num = 0;
+	}
+
+	sc->cl = sc->env = sc->up = NULL;
+	sc->next = vm->scope_pool;
+	vm->scope_pool = sc;
 }
 
-void tn_vm_free_scope (struct tn_scope *sc)
+/* gives sc's variables a VAL_SCOPE of their own, so that closures created in
+   sc can still use them once it returns */
+static struct tn_value *tn_vm_capture (struct tn_vm *vm, struct tn_scope *sc)
 {
-	if (!sc->keep) {
-		if (--sc->vars->refs == 0) {
-			free (sc->vars->arr);
-			free (sc->vars);
-		}
-		free (sc);
+	if (!sc->env) {
+		sc->vars->ch = sc->ch;
+		sc->env = tn_scope (vm, sc->vars, sc->up);
 	}
+
+	return sc->env;
 }
 
-void tn_vm_exec (struct tn_vm *vm, struct tn_chunk *ch, struct tn_value *cl, struct tn_scope *sc, int nargs)
+/* the interpreter loop is written in terms of these macros, so that it can
+   either be compiled as a direct-threaded loop (one indirect jump at the end of
+   every instruction, through a table of label addresses), or as a plain switch
+   for compilers that don't support computed gotos. define TN_VM_SWITCH to force
+   the latter. instructions are pre-decoded (see decode.c), so operands are just
+   read from the words following the opcode.
+
+   vm->error is only checked after instructions that can call out to something
+   that might set it (allocation, C functions, nested calls), with NEXT_CHECKED.
+   instructions that detect an error themselves jump straight to "error" */
+#if defined(__GNUC__) && !defined(TN_VM_SWITCH)
+#define TN_VM_THREADED
+#endif
+
+#ifdef TN_VM_THREADED
+#define OPCODE(OP) op_##OP
+#define DISPATCH() goto *dispatch[(ip++)->op]
+#define NEXT DISPATCH ()
+#else
+#define OPCODE(OP) case OP
+#define DISPATCH() switch ((ip++)->op)
+#define NEXT continue
+#endif
+
+#define NEXT_CHECKED \
+	if (vm->error) \
+		goto out; \
+	NEXT
+
+#ifdef TN_VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+void tn_vm_exec (struct tn_vm *vm, struct tn_chunk *ch, struct tn_value *cl, struct tn_value *env, int nargs)
 {
-	int tailcall = 0;
+	union tn_insn *ip;
 	struct tn_value *v1, *v2;
+	struct tn_scope *entry = vm->sc, *next, *sc;
+
+#ifdef TN_VM_THREADED
+	static const void *dispatch[256] = {
+		[0 ... 255] = &&op_OP_NOP,
+		[OP_NOP] = &&op_OP_NOP,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_SUB] = &&op_OP_SUB,
+		[OP_MUL] = &&op_OP_MUL,
+		[OP_DIV] = &&op_OP_DIV,
+		[OP_MOD] = &&op_OP_MOD,
+		[OP_EQ] = &&op_OP_EQ,
+		[OP_NEQ] = &&op_OP_NEQ,
+		[OP_LT] = &&op_OP_LT,
+		[OP_LTE] = &&op_OP_LTE,
+		[OP_GT] = &&op_OP_GT,
+		[OP_GTE] = &&op_OP_GTE,
+		[OP_ANDL] = &&op_OP_ANDL,
+		[OP_ORL] = &&op_OP_ORL,
+		[OP_CAT] = &&op_OP_CAT,
+		[OP_LCAT] = &&op_OP_LCAT,
+		[OP_PSHI] = &&op_OP_PSHI,
+		[OP_PSHD] = &&op_OP_PSHD,
+		[OP_PSHS] = &&op_OP_PSHS,
+		[OP_PSHV] = &&op_OP_PSHV,
+		[OP_SET] = &&op_OP_SET,
+		[OP_DROP] = &&op_OP_DROP,
+		[OP_CLSR] = &&op_OP_CLSR,
+		[OP_SELF] = &&op_OP_SELF,
+		[OP_NIL] = &&op_OP_NIL,
+		[OP_GLOB] = &&op_OP_GLOB,
+		[OP_GSLT] = &&op_OP_GSLT,
+		[OP_ARGS] = &&op_OP_ARGS,
+		[OP_JMP] = &&op_OP_JMP,
+		[OP_JNZ] = &&op_OP_JNZ,
+		[OP_JZ] = &&op_OP_JZ,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_TCAL] = &&op_OP_TCAL,
+		[OP_RET] = &&op_OP_RET,
+		[OP_EQJZ] = &&op_OP_EQJZ,
+		[OP_NEQJZ] = &&op_OP_NEQJZ,
+		[OP_LTJZ] = &&op_OP_LTJZ,
+		[OP_LTEJZ] = &&op_OP_LTEJZ,
+		[OP_GTJZ] = &&op_OP_GTJZ,
+		[OP_GTEJZ] = &&op_OP_GTEJZ,
+		[OP_ACCS] = &&op_OP_ACCS,
+		[OP_LSTS] = &&op_OP_LSTS,
+		[OP_LSTE] = &&op_OP_LSTE,
+		[OP_NEG] = &&op_OP_NEG,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_IMPT] = &&op_OP_IMPT,
+		[OP_PRNT] = &&op_OP_PRNT
+	};
+#endif
 
 	// set up the current scope
-	if (!sc) {
-		sc = tn_vm_scope (0);
-		if (!sc) {
-			tn_error ("couldn't allocate a new scope\n");
-			vm->error = 1;
-			return;
-		}
+	if (!(sc = tn_vm_scope_new (vm, env))) {
+		tn_error ("couldn't allocate a new scope\n");
+		vm->error = 1;
+		return;
 	}
 
-	sc->pc = 0;
+	if (env)
+		sc->vars->ch = ch;
+
 	sc->ch = ch;
-	sc->next = cl ? cl->data.cl->sc : vm->sc;
+	sc->cl = cl;
+
+	if (cl)
+		sc->up = cl->data.cl.env;
+
 	sc->gc_next = vm->sc; // the GC needs to traverse the real call stack
 	vm->sc = sc;
 
+	ip = ch->insns;
+
+	if (vm->error)
+		goto out;
+
 	// execute the chunk's code
-	while (!vm->error) {
-		//printf ("op: %x\n", ch->code[sc->pc]);
-		switch (ch->code[sc->pc++]) {
-			case OP_NOP: break;
-			case OP_ADD: numop (+);
-			case OP_SUB: numop (-);
-			case OP_MUL: numop (*);
-			case OP_DIV: numop (/);
-			case OP_MOD: // can't use numop here because we can't use doubles
+#ifdef TN_VM_THREADED
+	DISPATCH ();
+	{
+#else
+	for (;;) {
+		DISPATCH () {
+#endif
+			OPCODE (OP_NOP): NEXT;
+			OPCODE (OP_ADD): numop (+);
+			OPCODE (OP_SUB): numop (-);
+			OPCODE (OP_MUL): numop (*);
+			OPCODE (OP_DIV): numop (/);
+			OPCODE (OP_MOD): // can't use numop here because we can't use doubles
 				v2 = tn_vm_pop (vm);
 				v1 = tn_vm_pop (vm);
-				if (v1->type == VAL_INT && v2->type == VAL_INT)
-					tn_vm_push (vm, tn_int (vm, v1->data.i % v2->data.i));
-				else {
+				if (tn_type (v1) != VAL_INT || tn_type (v2) != VAL_INT) {
 					tn_error ("non-int passed to modulo\n");
-					vm->error = 1;
+					goto error;
 				}
-				break;
-			case OP_EQ: numop (==);
-			case OP_NEQ: numop (!=);
-			case OP_LT: numop (<);
-			case OP_LTE: numop (<=);
-			case OP_GT: numop (>);
-			case OP_GTE: numop (>=);
-			case OP_ANDL: // eventually use a boolean type for these, maybe
+
+				tn_vm_push (vm, tn_int (vm, tn_intval (v1) % tn_intval (v2)));
+				NEXT;
+			OPCODE (OP_EQ): numop (==);
+			OPCODE (OP_NEQ): numop (!=);
+			OPCODE (OP_LT): numop (<);
+			OPCODE (OP_LTE): numop (<=);
+			OPCODE (OP_GT): numop (>);
+			OPCODE (OP_GTE): numop (>=);
+			OPCODE (OP_ANDL): // eventually use a boolean type for these, maybe
 				v2 = tn_vm_pop (vm);
 				v1 = tn_vm_pop (vm);
 				tn_vm_push (vm, tn_int (vm, tn_value_true (v1) && tn_value_true (v2)));
-				break;
-			case OP_ORL:
+				NEXT;
+			OPCODE (OP_ORL):
 				v2 = tn_vm_pop (vm);
 				v1 = tn_vm_pop (vm);
 				tn_vm_push (vm, tn_int (vm, tn_value_true (v1) || tn_value_true (v2)));
-				break;
-			case OP_CAT:
+				NEXT;
+			OPCODE (OP_CAT):
 				v2 = tn_vm_pop (vm);
 				v1 = tn_vm_pop (vm);
 				tn_vm_push (vm, tn_value_cat (vm, v1, v2));
-				break;
-			case OP_LCAT:
+				NEXT_CHECKED;
+			OPCODE (OP_LCAT):
 				v2 = tn_vm_pop (vm);
 				v1 = tn_vm_pop (vm);
 				tn_vm_push (vm, tn_value_lcat (vm, v1, v2));
-				break;
-			case OP_PSHI:
-				tn_vm_push (vm, tn_int (vm, tn_vm_read32 (vm)));
-				break;
-			case OP_PSHD:
-				tn_vm_push (vm, tn_double (vm, tn_vm_readdouble (vm)));
-				break;
-			case OP_PSHS:
-				tn_vm_push (vm, tn_string (vm, tn_vm_readstring (vm)));
-				break;
-			case OP_PSHV: {
-				struct tn_scope *s = sc;
-				uint16_t depth = tn_vm_read16 (vm);
-				int32_t i = tn_vm_read32 (vm) - 1;
-
-				while (depth--)
-					s = s->next;
+				NEXT_CHECKED;
+			OPCODE (OP_PSHI):
+				tn_vm_push (vm, tn_int (vm, (ip++)->i));
+				NEXT;
+			OPCODE (OP_PSHD):
+				tn_vm_push (vm, (ip++)->v);
+				NEXT;
+			OPCODE (OP_PSHS):
+				tn_vm_push (vm, (ip++)->v);
+				NEXT;
+			OPCODE (OP_PSHV): {
+				struct tn_scope_vars *vars = sc->vars;
+				uint16_t depth = ip->var.depth;
+				uint32_t i = (ip++)->var.idx;
+
+				if (depth) {
+					struct tn_value *e = sc->up;
+
+					while (--depth)
+						e = e->data.env.up;
+
+					vars = e->data.env.vars;
+				}
 
-				if (i < s->vars->arr_num)
-					tn_vm_push (vm, s->vars->arr[i]);
-				else {
+				if (i >= vars->arr_num) {
 					tn_error ("unbound variable %i\n", i + 1);
-					vm->error = 1;
+					goto error;
 				}
-				break;
+
+				tn_vm_push (vm, vars->arr[i]);
+				NEXT;
 			}
-			case OP_SET:
-				array_add_at (sc->vars->arr, vm->stack[vm->sp - 1], tn_vm_read32 (vm) - 1);
-				break;
-			case OP_DROP:
+			OPCODE (OP_SET):
+				array_add_at (sc->vars->arr, vm->stack[vm->sp - 1], (ip++)->u);
+				NEXT;
+			OPCODE (OP_DROP):
 				tn_vm_pop (vm);
-				break;
-			case OP_CLSR:
-				tn_vm_push (vm, tn_closure (vm, tn_vm_closure (vm)));
-				break;
-			case OP_SELF:
+				NEXT;
+			OPCODE (OP_CLSR):
+				if (!tn_vm_capture (vm, sc))
+					goto error;
+
+				tn_vm_push (vm, tn_closure (vm, (ip++)->ch, sc->env));
+				NEXT_CHECKED;
+			OPCODE (OP_SELF):
 				if (cl)
 					tn_vm_push (vm, cl);
-				break;
-			case OP_NIL:
+				NEXT;
+			OPCODE (OP_NIL):
 				tn_vm_push (vm, &nil);
-				break;
-			case OP_GLOB: {
-				// with globals, we push a reference to a value, tn_vm_pop will deref it
-				char *name = tn_vm_readstring (vm);
-				struct tn_value **ref = tn_hash_search_ref (vm->globals, name);
-
-				if (ref)
-					tn_vm_push (vm, tn_vref (vm, ref));
-				else {
-					tn_error ("unbound variable %s\n", name);
-					vm->error = 1;
+				NEXT;
+			OPCODE (OP_GLOB): {
+				// look the global up once, then patch this into an OP_GSLT
+				uint32_t slot = (uintptr_t)tn_hash_search (vm->globals, ip->s);
+
+				if (slot == 0) {
+					tn_error ("unbound variable %s\n", ip->s);
+					goto error;
 				}
-				break;
-			}
-			case OP_ARGS: {
-				int i, op_nargs;
-				uint8_t varargs = tn_vm_read8 (vm);
 
-				op_nargs = tn_vm_read32 (vm);
+				ip[-1].op = OP_GSLT;
+				ip->u = slot - 1;
+			}
+			// fall through
+			OPCODE (OP_GSLT):
+				tn_vm_push (vm, vm->gvals[(ip++)->u]);
+				NEXT;
+			OPCODE (OP_ARGS): {
+				int i, op_nargs = ip->args.n;
+				uint8_t varargs = (ip++)->args.varargs;
 
 				for (i = 1; i <= op_nargs; i++) {
 					if (varargs && i == op_nargs) {
@@ -369,136 +462,297 @@ void tn_vm_exec (struct tn_vm *vm, struct tn_chunk *ch, struct tn_value *cl, str
 
 					array_add_at (sc->vars->arr, tn_vm_pop (vm), i - 1);
 				}
-				break;
+				NEXT_CHECKED;
 			}
-			case OP_JMP:
-				vm->sc->pc = tn_vm_read32 (vm);
-				break;
-			case OP_JNZ:
+			OPCODE (OP_JMP):
+				ip = ip->jmp;
+				NEXT;
+			OPCODE (OP_JNZ):
 				v1 = tn_vm_pop (vm);
 				if (tn_value_true (v1))
-					vm->sc->pc = tn_vm_read32 (vm);
+					ip = ip->jmp;
 				else
-					vm->sc->pc += 4;
-				break;
-			case OP_JZ:
+					ip++;
+				NEXT;
+			OPCODE (OP_JZ):
 				v1 = tn_vm_pop (vm);
 				if (tn_value_false (v1))
-					vm->sc->pc = tn_vm_read32 (vm);
+					ip = ip->jmp;
 				else
-					vm->sc->pc += 4;
-				break;
-			case OP_TCAL:
-				tailcall = 1;
-			case OP_CALL:
+					ip++;
+				NEXT;
+			OPCODE (OP_EQJZ): cmpjz (==);
+			OPCODE (OP_NEQJZ): cmpjz (!=);
+			OPCODE (OP_LTJZ): cmpjz (<);
+			OPCODE (OP_LTEJZ): cmpjz (<=);
+			OPCODE (OP_GTJZ): cmpjz (>);
+			OPCODE (OP_GTEJZ): cmpjz (>=);
+			OPCODE (OP_CALL):
+				v1 = tn_vm_pop (vm);
+				nargs = (ip++)->u;
+			call:
+				if (tn_type (v1) == VAL_CLSR) {
+					struct tn_scope *s = tn_vm_scope_new (vm, NULL);
+
+					if (!s) {
+						tn_error ("couldn't allocate a new scope\n");
+						goto error;
+					}
+
+					// save where we are, and switch over to the callee
+					sc->ip = ip;
+					s->gc_next = sc;
+					vm->sc = sc = s;
+					goto enter;
+				}
+				else if (tn_type (v1) == VAL_CFUN) {
+					v1->data.cfun (vm, nargs);
+					sc->scanned = 0;
+
+					// the C function might want to call something in its place
+					if (vm->tcall) {
+						v1 = vm->tcall;
+						nargs = vm->tcall_nargs;
+						vm->tcall = NULL;
+						goto call;
+					}
+				}
+				NEXT_CHECKED;
+			OPCODE (OP_TCAL):
 				v1 = tn_vm_pop (vm);
+				nargs = (ip++)->u;
 
+				// the current scope is done either way, get rid of it before the call
+				next = sc->gc_next;
 
-				if (v1->type == VAL_CLSR) {
-					if (tailcall && v1 == cl) {
-						sc->pc = 0;
-						tailcall = 0;
-						continue;
+				if (tn_type (v1) == VAL_CLSR) {
+					struct tn_scope *s;
+
+					tn_vm_free_scope (vm, sc);
+					s = tn_vm_scope_new (vm, NULL);
+
+					if (!s) {
+						tn_error ("couldn't allocate a new scope\n");
+						vm->sc = sc = next;
+						goto error;
 					}
 
-					tn_vm_exec (vm, v1->data.cl->ch, v1, NULL, tn_vm_read32 (vm));
-					vm->sc = sc;
+					s->gc_next = next;
+					vm->sc = sc = s;
+					goto enter;
 				}
-				else if (v1->type == VAL_CFUN)
-					v1->data.cfun (vm, tn_vm_read32 (vm));
-				break;
-			case OP_ACCS: {
-				const char *item = tn_vm_readstring (vm);
+				else if (tn_type (v1) == VAL_CFUN) {
+					// return to our caller, and make the call on its behalf
+					tn_vm_free_scope (vm, sc);
+					vm->sc = sc = next;
+
+					if (next == entry) {
+						tn_vm_call (vm, v1, nargs);
+						goto done;
+					}
+
+					ch = sc->ch;
+					cl = sc->cl;
+					ip = sc->ip;
+					goto call;
+				}
+				NEXT_CHECKED;
+			enter:
+				cl = v1;
+				ch = cl->data.cl.ch;
+				ip = ch->insns;
+
+				sc->ch = ch;
+				sc->cl = cl;
+				sc->up = cl->data.cl.env;
+				NEXT;
+			OPCODE (OP_ACCS): {
+				const char *item = (ip++)->s;
 				uint32_t itemn;
 
 				v1 = tn_vm_pop (vm);
 
-				if (v1->type == VAL_PAIR) {
+				if (tn_type (v1) == VAL_PAIR) {
 					if (item[0] == 'h' && item[1] == '\0')
 						tn_vm_push (vm, v1->data.pair.a);
 					else if (item[0] == 't' && item[1] == '\0')
 						tn_vm_push (vm, v1->data.pair.b);
 					else {
 						tn_error ("invalid access to list\n");
-						vm->error = 1;
+						goto error;
 					}
 				}
-				else if (v1->type == VAL_SCOPE) { // module access
-					itemn = (uint32_t)tn_hash_search (v1->data.sc->ch->vars->hash, item);
+				else if (tn_type (v1) == VAL_SCOPE) { // module access
+					itemn = (uint32_t)tn_hash_search (v1->data.env.vars->ch->vars->hash, item);
 					if (itemn == 0) {
 						tn_error ("unbound variable %s in module\n", item);
-						vm->error = 1;
+						goto error;
 					}
 
-					tn_vm_push (vm, v1->data.sc->vars->arr[itemn - 1]);
+					tn_vm_push (vm, v1->data.env.vars->arr[itemn - 1]);
 				}
-				else if (v1->type == VAL_CMOD) {
+				else if (tn_type (v1) == VAL_CMOD) {
 					struct tn_value *val = tn_hash_search (v1->data.cmod, item);
 
-					if (val)
-						tn_vm_push (vm, val);
-					else {
+					if (!val) {
 						tn_error ("unbound variable %s in C module\n", item);
-						vm->error = 1;
+						goto error;
 					}
+
+					tn_vm_push (vm, val);
 				}
-				break;
+				NEXT;
 			}
-			case OP_LSTS:
+			OPCODE (OP_LSTS):
 				tn_vm_push (vm, &lststart);
-				break;
-			case OP_LSTE:
-				v1 = tn_value_lste (vm);
-				tn_vm_push (vm, v1);
-				tn_gc_release_list (v1);
-				break;
-			case OP_NEG:
+				NEXT;
+			OPCODE (OP_LSTE):
+				tn_vm_push (vm, tn_value_lste (vm));
+				NEXT_CHECKED;
+			OPCODE (OP_NEG):
 				v1 = tn_vm_pop (vm);
-				if (v1->type == VAL_INT)
-					tn_vm_push (vm, tn_int (vm, -v1->data.i));
-				else if (v1->type == VAL_DBL)
-					tn_vm_push (vm, tn_double (vm, -v1->data.d));
-				break;
-			case OP_NOT:
+				if (tn_type (v1) == VAL_INT) {
+					tn_vm_push (vm, tn_int (vm, -tn_intval (v1)));
+					NEXT;
+				}
+				else if (tn_type (v1) == VAL_DBL)
+					tn_vm_push (vm, tn_double (vm, -tn_dblval (v1)));
+				NEXT_CHECKED;
+			OPCODE (OP_NOT):
 				v1 = tn_vm_pop (vm);
 				tn_vm_push (vm, tn_int (vm, tn_value_false (v1)));
-				break;
-			case OP_IMPT: {
-				struct tn_chunk *mod = tn_import_load (tn_vm_readstring (vm), sc->ch->path);
-				struct tn_scope *s = tn_vm_scope (1);
+				NEXT;
+			OPCODE (OP_IMPT): {
+				const char *name = (ip++)->s;
+				struct tn_chunk *mod;
+				struct tn_value *env = tn_vm_env (vm);
+				int top = tn_gc_root (vm->gc, &env);
+
+				// the module's variables are only reachable through env once it's done
+				if (env && (mod = tn_import_load (vm, name, sc->ch->path))) {
+					tn_vm_exec (vm, mod, NULL, env, 0);
+
+					if (!vm->error)
+						tn_vm_pop (vm); // whatever the module's last expression was
+				}
+				else if (env) {
+					tn_error ("couldn't import %s\n", name);
+					vm->error = 1;
+				}
 
-				tn_vm_exec (vm, mod, NULL, s, 0);
-				tn_vm_push (vm, tn_scope (vm, s));
-				vm->sc = sc;
-				break;
+				sc->scanned = 0;
+				tn_gc_unroot (vm->gc, top);
+				tn_vm_push (vm, env);
+				NEXT_CHECKED;
 			}
-			case OP_PRNT:
+			OPCODE (OP_PRNT):
 				v1 = tn_vm_pop (vm);
 				tn_vm_print (v1);
 				printf ("\n");
 				tn_vm_push (vm, &nil);
-				break;
-			case OP_RET:
-				goto out;
-			default: break;
+				NEXT;
+			OPCODE (OP_RET):
+				next = sc->gc_next;
+				tn_vm_free_scope (vm, sc);
+
+				if (next == entry)
+					goto done;
+
+				// return to the caller
+				vm->sc = sc = next;
+				sc->scanned = 0;
+				ch = sc->ch;
+				cl = sc->cl;
+				ip = sc->ip;
+				NEXT;
+#ifndef TN_VM_THREADED
+			default: NEXT;
 		}
+#endif
 	}
+
+error:
+	vm->error = 1;
 out:
-	tn_vm_free_scope (vm->sc);
-	vm->sc = NULL;
-	return;
+	vm->tcall = NULL;
+
+	// unwind whatever is left of the call stack
+	while (sc != entry) {
+		next = sc->gc_next;
+		tn_vm_free_scope (vm, sc);
+		sc = next;
+	}
+done:
+	vm->sc = entry;
+}
+
+// call a closure or C function from C, with nargs arguments on the stack
+void tn_vm_call (struct tn_vm *vm, struct tn_value *fn, int nargs)
+{
+	while (fn) {
+		switch (tn_type (fn)) {
+			case VAL_CLSR:
+				tn_vm_exec (vm, fn->data.cl.ch, fn, NULL, nargs);
+				break;
+			case VAL_CFUN:
+				fn->data.cfun (vm, nargs);
+				break;
+			default:
+				tn_error ("attempt to call a non-function value\n");
+				vm->error = 1;
+				return;
+		}
+
+		fn = vm->tcall;
+		nargs = vm->tcall_nargs;
+		vm->tcall = NULL;
+	}
 }
 
+/* have the VM call fn with nargs arguments in place of the C function that's
+   currently running, once it returns. the C function shouldn't push a return
+   value of its own. this way, things like apply don't need to nest another
+   tn_vm_exec, so they can be used for tail calls too */
+void tn_vm_tailcall (struct tn_vm *vm, struct tn_value *fn, int nargs)
+{
+	vm->tcall = fn;
+	vm->tcall_nargs = nargs;
+}
+
+#ifdef TN_VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
 void tn_vm_setglobal (struct tn_vm *vm, const char *name, struct tn_value *val)
 {
-	if (tn_hash_insert (vm->globals, name, val)) {
-		tn_error ("failed to set global\n");
+	uint32_t slot;
+
+	if (!(name = tn_intern (name))) {
 		vm->error = 1;
+		return;
 	}
+
+	slot = (uintptr_t)tn_hash_search (vm->globals, name);
+
+	// slots are never reused, so code that has already resolved a global stays valid
+	if (slot == 0) {
+		slot = vm->gvals_num + 1;
+
+		if (tn_hash_insert (vm->globals, name, (void*)(uintptr_t)slot)) {
+			tn_error ("failed to set global\n");
+			vm->error = 1;
+			return;
+		}
+	}
+
+	array_add_at (vm->gvals, val, slot - 1);
+
+	if (vm->gc->state == GC_MARK)
+		tn_gc_shade (vm->gc, val);
 }
 
 void tn_apply (struct tn_vm *vm, int n);
-struct tn_vm *tn_vm_init (uint32_t init_ss)
+struct tn_vm *tn_vm_init (uint32_t init_ss, const struct tn_gc_opts *opts)
 {
 	struct tn_vm *ret = malloc (sizeof (*ret));
 
@@ -517,9 +771,12 @@ struct tn_vm *tn_vm_init (uint32_t init_ss)
 	ret->ss = init_ss;
 	ret->error = 0;
 
-	ret->sc = NULL;
+	ret->sc = ret->scope_pool = NULL;
+	ret->tcall = NULL;
+	ret->tcall_nargs = 0;
 	ret->globals = tn_hash_new (8);
-	ret->gc = tn_gc_init (ret, sizeof (struct tn_value) * 10);
+	array_init (ret->gvals);
+	ret->gc = tn_gc_init (ret, opts);
 
 	if (!ret->gc) {
 		free (ret);
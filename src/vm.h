@@ -5,58 +5,100 @@
 #include "array.h"
 
 struct tn_hash;
+struct tn_arena;
+struct tn_chunk;
+
+// pre-decoded instruction stream, see decode.c
+union tn_insn {
+	uint8_t op;
+	int32_t i;
+	uint32_t u;
+	double d;
+	const char *s;
+	struct tn_chunk *ch;
+	union tn_insn *jmp;
+	struct tn_value *v;
+	struct {
+		uint16_t depth;
+		uint32_t idx;
+	} var;
+	struct {
+		uint8_t varargs;
+		uint32_t n;
+	} args;
+};
+
 struct tn_chunk {
-	uint8_t *code;
+	uint8_t *code; // in the compilation's arena, and gone once the chunk is decoded
 	uint32_t pc, codelen;
 	array_def (subch, struct tn_chunk*);
 
+	union tn_insn *insns;
+	uint32_t insnlen;
+	array_def (consts, struct tn_value*); // GC values, kept alive through the owner
+
 	const char *path;
 
+	/* the VAL_CHUNK value that the whole tree of chunks this belongs to is
+	   freed with. closures and running scopes keep it alive */
+	struct tn_value *owner;
+
 	// compiler specific stuff, the VM doesn't do anything with this
+	struct tn_arena *arena;
 	const char *name;
 	struct tn_chunk_vars {
-		uint32_t maxid;
+		uint32_t maxid, refs; // shared between the lines of the REPL
 		struct tn_hash *hash;
 	} *vars;
 	struct tn_chunk *next;
 };
 
 struct tn_value;
+
+/* a scope is the activation record for a chunk that's being run. gc_next
+   links the active scopes into the call stack, and the caller's ip is saved in
+   its own scope when it calls into another closure. scopes are reused once
+   they return, variables and all, unless something captured the variables
+   (see tn_vm_capture). then they belong to a VAL_SCOPE value, and the GC frees
+   them once nothing refers to it */
 struct tn_scope {
-	uint32_t pc;
-	uint8_t keep;
+	union tn_insn *ip;
+	uint8_t scanned; // not run since the GC last scanned it, see tn_gc_mark_roots
 	struct tn_chunk *ch;
+	struct tn_value *cl; // closure being executed, if any
 
 	struct tn_scope_vars {
 		array_def (arr, struct tn_value*);
-		uint32_t refs;
+		struct tn_chunk *ch; // for looking variables up by name, in modules
 	} *vars;
 
-	struct tn_scope *next, *gc_next;
-};
+	struct tn_value *env; // VAL_SCOPE holding vars, once they've been captured
+	struct tn_value *up; // enclosing scope's VAL_SCOPE, from the closure
 
-struct tn_closure {
-	struct tn_chunk *ch;
-	struct tn_scope *sc; // saves the call stack at closure creation
+	struct tn_scope *next, *gc_next; // next is only used by vm->scope_pool
 };
 
 struct tn_gc;
+struct tn_gc_opts;
 struct tn_vm {
 	struct tn_value **stack;
 	unsigned int sp, sb, ss, error;
-	struct tn_scope *sc;
-	struct tn_hash *globals;
+	struct tn_scope *sc, *scope_pool;
+	struct tn_value *tcall; // see tn_vm_tailcall
+	int tcall_nargs;
+	struct tn_hash *globals; // name -> slot in gvals, plus one
+	array_def (gvals, struct tn_value*);
 	struct tn_gc *gc;
 };
 
 void tn_vm_push (struct tn_vm *vm, struct tn_value *val);
 struct tn_value *tn_vm_pop (struct tn_vm *vm);
 void tn_vm_print (struct tn_value *val);
-void tn_vm_exec (struct tn_vm *vm, struct tn_chunk *ch, struct tn_value *cl, struct tn_scope *sc, int nargs);
-struct tn_scope *tn_vm_scope (uint8_t keep);
-void tn_vm_scope_inc_ref (struct tn_scope *sc);
-void tn_vm_scope_dec_ref (struct tn_scope *sc);
+void tn_vm_exec (struct tn_vm *vm, struct tn_chunk *ch, struct tn_value *cl, struct tn_value *env, int nargs);
+void tn_vm_call (struct tn_vm *vm, struct tn_value *fn, int nargs);
+void tn_vm_tailcall (struct tn_vm *vm, struct tn_value *fn, int nargs);
+struct tn_value *tn_vm_env (struct tn_vm *vm);
 void tn_vm_setglobal (struct tn_vm *vm, const char *name, struct tn_value *val);
-struct tn_vm *tn_vm_init (uint32_t init_ss);
+struct tn_vm *tn_vm_init (uint32_t init_ss, const struct tn_gc_opts *opts); // opts can be NULL for the defaults
 
 #endif